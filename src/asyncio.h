@@ -0,0 +1,303 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_ASYNCIO_H
+#define MSGPACK_TOOLS_ASYNCIO_H 1
+
+// Pipelined input and output on background threads, enabled with -a.
+//
+// An async_reader_t prefetches blocks of input on a reader thread, so the
+// converter only waits on input when the reader can't keep up with it. An
+// async_writer_t takes filled output blocks and writes them out on a writer
+// thread while the converter fills the next one. Each keeps a ring of
+// ASYNC_BLOCKS blocks; the threads only synchronize once per block.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ASYNC_BLOCKS 4
+
+// The range of block sizes that can be requested with -a, in KiB.
+#define ASYNC_MIN_BLOCK_KB 4
+#define ASYNC_MAX_BLOCK_KB (256 * 1024)
+
+typedef struct async_block_t {
+    char* data;
+    size_t size;
+} async_block_t;
+
+static bool async_blocks_alloc(async_block_t* blocks, size_t block_size) {
+    memset(blocks, 0, sizeof(async_block_t) * ASYNC_BLOCKS);
+    for (size_t i = 0; i < ASYNC_BLOCKS; ++i) {
+        blocks[i].data = (char*)malloc(block_size);
+        if (!blocks[i].data) {
+            for (size_t j = 0; j < i; ++j)
+                free(blocks[j].data);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void async_blocks_free(async_block_t* blocks) {
+    for (size_t i = 0; i < ASYNC_BLOCKS; ++i)
+        free(blocks[i].data);
+}
+
+typedef struct async_reader_t {
+    int fd;
+    size_t block_size;
+    async_block_t blocks[ASYNC_BLOCKS];
+    size_t head;   // blocks read
+    size_t tail;   // blocks consumed
+    size_t offset; // consumer's position in the block at tail
+    bool eof;
+    bool error;
+    bool stopping;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t thread;
+} async_reader_t;
+
+// The reader thread issues one read() per block, so a block may be partly
+// filled. This keeps latency low on pipes: whatever has arrived is handed to
+// the converter right away.
+//
+// The thread may be blocked in read() when the converter is done (for
+// example if it only needed the first element of an endless pipe), so it is
+// cancelled when stopped. read() is the only point where cancellation is
+// enabled.
+static void* async_reader_thread(void* arg) {
+    async_reader_t* reader = (async_reader_t*)arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&reader->mutex);
+
+    while (true) {
+        while (reader->head - reader->tail == ASYNC_BLOCKS && !reader->stopping)
+            pthread_cond_wait(&reader->changed, &reader->mutex);
+        if (reader->stopping)
+            break;
+
+        async_block_t* block = &reader->blocks[reader->head % ASYNC_BLOCKS];
+        pthread_mutex_unlock(&reader->mutex);
+
+        ssize_t n;
+        do {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            n = read(reader->fd, block->data, reader->block_size);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        } while (n < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&reader->mutex);
+        if (n <= 0) {
+            reader->error = n < 0;
+            reader->eof = true;
+            pthread_cond_broadcast(&reader->changed);
+            break;
+        }
+        block->size = (size_t)n;
+        ++reader->head;
+        pthread_cond_broadcast(&reader->changed);
+    }
+
+    pthread_mutex_unlock(&reader->mutex);
+    return NULL;
+}
+
+static bool async_reader_start(async_reader_t* reader, int fd, size_t block_size) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->block_size = block_size;
+    if (!async_blocks_alloc(reader->blocks, block_size))
+        return false;
+
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if (pthread_create(&reader->thread, NULL, async_reader_thread, reader) != 0) {
+        pthread_mutex_destroy(&reader->mutex);
+        pthread_cond_destroy(&reader->changed);
+        async_blocks_free(reader->blocks);
+        return false;
+    }
+    return true;
+}
+
+// Copies up to count bytes of input into the buffer, waiting if none have
+// been read yet. Returns 0 at the end of the input or on error, in which
+// case error is set.
+static size_t async_read(async_reader_t* reader, char* buffer, size_t count) {
+    pthread_mutex_lock(&reader->mutex);
+    while (reader->head == reader->tail && !reader->eof)
+        pthread_cond_wait(&reader->changed, &reader->mutex);
+    if (reader->head == reader->tail) {
+        pthread_mutex_unlock(&reader->mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&reader->mutex);
+
+    // The reader thread doesn't touch the block at tail until we release it.
+    async_block_t* block = &reader->blocks[reader->tail % ASYNC_BLOCKS];
+    size_t n = block->size - reader->offset;
+    if (n > count)
+        n = count;
+    memcpy(buffer, block->data + reader->offset, n);
+    reader->offset += n;
+
+    if (reader->offset == block->size) {
+        reader->offset = 0;
+        pthread_mutex_lock(&reader->mutex);
+        ++reader->tail;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->mutex);
+    }
+    return n;
+}
+
+static void async_reader_stop(async_reader_t* reader) {
+    pthread_mutex_lock(&reader->mutex);
+    reader->stopping = true;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->mutex);
+
+    pthread_cancel(reader->thread);
+    pthread_join(reader->thread, NULL);
+
+    pthread_mutex_destroy(&reader->mutex);
+    pthread_cond_destroy(&reader->changed);
+    async_blocks_free(reader->blocks);
+}
+
+typedef struct async_writer_t {
+    FILE* file;
+    size_t block_size;
+    async_block_t blocks[ASYNC_BLOCKS];
+    size_t head; // blocks submitted; the block at head is being filled
+    size_t tail; // blocks written
+    bool error;
+    bool stopping;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t thread;
+} async_writer_t;
+
+// After an error the writer thread keeps taking blocks without writing them
+// so that the converter never waits on it.
+static void* async_writer_thread(void* arg) {
+    async_writer_t* writer = (async_writer_t*)arg;
+    pthread_mutex_lock(&writer->mutex);
+
+    while (true) {
+        while (writer->tail == writer->head && !writer->stopping)
+            pthread_cond_wait(&writer->changed, &writer->mutex);
+        if (writer->tail == writer->head)
+            break;
+
+        async_block_t* block = &writer->blocks[writer->tail % ASYNC_BLOCKS];
+        bool error = writer->error;
+        pthread_mutex_unlock(&writer->mutex);
+
+        bool wrote = error || fwrite(block->data, 1, block->size, writer->file) == block->size;
+
+        pthread_mutex_lock(&writer->mutex);
+        if (!wrote)
+            writer->error = true;
+        ++writer->tail;
+        pthread_cond_broadcast(&writer->changed);
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+static bool async_writer_start(async_writer_t* writer, FILE* file, size_t block_size) {
+    memset(writer, 0, sizeof(*writer));
+    writer->file = file;
+    writer->block_size = block_size;
+    if (!async_blocks_alloc(writer->blocks, block_size))
+        return false;
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, async_writer_thread, writer) != 0) {
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->changed);
+        async_blocks_free(writer->blocks);
+        return false;
+    }
+    return true;
+}
+
+// Returns the block to fill first.
+static char* async_writer_buffer(async_writer_t* writer) {
+    return writer->blocks[0].data;
+}
+
+// Submits the block being filled, which holds size bytes, and returns the
+// next block to fill. Waits if all other blocks are still being written.
+static char* async_write(async_writer_t* writer, size_t size) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->blocks[writer->head % ASYNC_BLOCKS].size = size;
+    ++writer->head;
+    pthread_cond_broadcast(&writer->changed);
+    while (writer->head - writer->tail == ASYNC_BLOCKS)
+        pthread_cond_wait(&writer->changed, &writer->mutex);
+    char* data = writer->blocks[writer->head % ASYNC_BLOCKS].data;
+    pthread_mutex_unlock(&writer->mutex);
+    return data;
+}
+
+// Waits until all submitted blocks have been written. Returns false if any
+// write failed.
+static bool async_writer_sync(async_writer_t* writer) {
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->tail != writer->head)
+        pthread_cond_wait(&writer->changed, &writer->mutex);
+    bool ok = !writer->error;
+    pthread_mutex_unlock(&writer->mutex);
+    return ok;
+}
+
+// Writes out all submitted blocks and stops the writer thread. Returns false
+// if any write failed.
+static bool async_writer_stop(async_writer_t* writer) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->changed);
+    async_blocks_free(writer->blocks);
+    return !writer->error;
+}
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSGPACK_TOOLS_BASE64_H
+#define MSGPACK_TOOLS_BASE64_H 1
+
+// Base64 conversion with SIMD kernels for x86, selected at runtime based on
+// the features of the CPU. The kernels only handle whole blocks; everything
+// else (line breaks, padding, invalid characters, and the ragged end of the
+// data) is handled by scalar code.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define BASE64_X86 1
+    #include <immintrin.h>
+#else
+    #define BASE64_X86 0
+#endif
+
+#define BASE64_SKIP 64
+#define BASE64_INVALID 255
+
+// Maps base64 characters to their 6-bit values. Padding and line breaks are
+// skipped; everything else is invalid.
+static const uint8_t base64_decode_table[256] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  64, 255, 255,  64, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255,  64, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+// A decode kernel converts as many whole blocks of base64 characters as it
+// can, stopping at the first block that contains anything else. It returns
+// the number of characters consumed, which is always a multiple of four; the
+// output is exactly three bytes for every four characters.
+typedef size_t (*base64_decode_kernel_t)(const char* in, size_t length, char* out);
+
+static size_t base64_decode_kernel_scalar(const char* in, size_t length, char* out) {
+    return 0;
+}
+
+#if BASE64_X86
+
+// Writes the 12 bytes packed into the low end of a vector.
+__attribute__((target("ssse3")))
+static inline void base64_store12(char* out, __m128i bytes) {
+    _mm_storel_epi64((__m128i*)out, bytes);
+    uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+    memcpy(out + 8, &last, 4);
+}
+
+// Translation of characters to sextets is done with nibble lookups (see
+// Wojciech Mula's "Base64 encoding and decoding at almost the speed of a
+// memory copy".) The high nibble of each character selects the valid range
+// for that row of the ASCII table and the offset to add to get its value;
+// '/' shares a row with '+' so it's fixed up separately.
+
+__attribute__((target("ssse3")))
+static size_t base64_decode_kernel_ssse3(const char* in, size_t length, char* out) {
+    const __m128i lower_lut = _mm_setr_epi8(1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1);
+    const __m128i upper_lut = _mm_setr_epi8(0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i shift_lut = _mm_setr_epi8(0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50,
+            0x1a - 0x61, 0x29 - 0x70, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i pack_shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi32(chars, 4), nibble_mask);
+        __m128i is_slash = _mm_cmpeq_epi8(chars, slash);
+        __m128i below = _mm_cmplt_epi8(chars, _mm_shuffle_epi8(lower_lut, high));
+        __m128i above = _mm_cmpgt_epi8(chars, _mm_shuffle_epi8(upper_lut, high));
+        __m128i outside = _mm_andnot_si128(is_slash, _mm_or_si128(below, above));
+        if (_mm_movemask_epi8(outside) != 0)
+            break;
+
+        __m128i values = _mm_add_epi8(chars, _mm_shuffle_epi8(shift_lut, high));
+        values = _mm_add_epi8(values, _mm_and_si128(is_slash, _mm_set1_epi8(-3)));
+
+        // merge four sextets into three bytes in each 32-bit lane
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        base64_store12(out, _mm_shuffle_epi8(merged, pack_shuffle));
+        out += 12;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_decode_kernel_avx2(const char* in, size_t length, char* out) {
+    const __m256i lower_lut = _mm256_setr_epi8(
+            1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1,
+            1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1);
+    const __m256i upper_lut = _mm256_setr_epi8(
+            0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i shift_lut = _mm256_setr_epi8(
+            0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+            0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+            0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i pack_shuffle = _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi32(chars, 4), nibble_mask);
+        __m256i is_slash = _mm256_cmpeq_epi8(chars, slash);
+        __m256i below = _mm256_cmpgt_epi8(_mm256_shuffle_epi8(lower_lut, high), chars);
+        __m256i above = _mm256_cmpgt_epi8(chars, _mm256_shuffle_epi8(upper_lut, high));
+        __m256i outside = _mm256_andnot_si256(is_slash, _mm256_or_si256(below, above));
+        if (_mm256_movemask_epi8(outside) != 0)
+            break;
+
+        __m256i values = _mm256_add_epi8(chars, _mm256_shuffle_epi8(shift_lut, high));
+        values = _mm256_add_epi8(values, _mm256_and_si256(is_slash, _mm256_set1_epi8(-3)));
+
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack_shuffle);
+        base64_store12(out, _mm256_castsi256_si128(merged));
+        base64_store12(out + 12, _mm256_extracti128_si256(merged, 1));
+        out += 24;
+    }
+
+    // finish with the SSE kernel, which may get one more half block
+    return i + base64_decode_kernel_ssse3(in + i, length - i, out);
+}
+
+#endif
+
+static base64_decode_kernel_t base64_select_decode_kernel() {
+    #if BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return base64_decode_kernel_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return base64_decode_kernel_ssse3;
+    #endif
+    return base64_decode_kernel_scalar;
+}
+
+static const base64_decode_kernel_t base64_decode_kernel = base64_select_decode_kernel();
+
+// Returns the maximum number of bytes that base64_decode() will write for
+// input of the given length.
+static inline size_t base64_decoded_size(size_t length) {
+    return length / 4 * 3 + 2;
+}
+
+// Decodes base64 in a single pass, validating as it goes. Like libb64,
+// padding characters and line breaks are ignored anywhere in the input and
+// trailing bits of an incomplete group are discarded. Returns false if the
+// input contains any other character, storing its offset in error_offset.
+static bool base64_decode(const char* in, size_t length, char* out, size_t* out_length, size_t* error_offset) {
+    const char* out_start = out;
+    uint32_t bits = 0;
+    int count = 0; // number of sextets in bits
+    bool try_kernel = true;
+    size_t i = 0;
+
+    while (i < length) {
+
+        // The kernel can only take over at a group boundary. Once it stops
+        // there must be something other than plain base64 in its next
+        // block, so we don't try again until we've passed a character we
+        // skip.
+        if (try_kernel && count == 0) {
+            size_t n = base64_decode_kernel(in + i, length - i, out);
+            i += n;
+            out += n / 4 * 3;
+            try_kernel = false;
+            continue;
+        }
+
+        uint8_t value = base64_decode_table[(uint8_t)in[i]];
+        if (value < 64) {
+            bits = (bits << 6) | value;
+            if (++count == 4) {
+                out[0] = (char)(bits >> 16);
+                out[1] = (char)(bits >> 8);
+                out[2] = (char)bits;
+                out += 3;
+                bits = 0;
+                count = 0;
+            }
+        } else if (value == BASE64_SKIP) {
+            try_kernel = true;
+        } else {
+            *error_offset = i;
+            return false;
+        }
+        ++i;
+    }
+
+    if (count == 2) {
+        *out++ = (char)(bits >> 4);
+    } else if (count == 3) {
+        *out++ = (char)(bits >> 10);
+        *out++ = (char)(bits >> 2);
+    }
+
+    *out_length = (size_t)(out - out_start);
+    return true;
+}
+
+
+static const char base64_encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// An encode kernel converts as many whole blocks of input as it can. It
+// returns the number of bytes consumed, which is always a multiple of three;
+// the output is exactly four characters for every three bytes.
+typedef size_t (*base64_encode_kernel_t)(const char* in, size_t length, char* out);
+
+static size_t base64_encode_kernel_scalar(const char* in, size_t length, char* out) {
+    return 0;
+}
+
+#if BASE64_X86
+
+// The encode kernels spread each three bytes into four 6-bit indices with
+// multiplies, then translate the indices to characters by reducing each to
+// one of 14 ranges and looking up the offset to add for that range.
+
+__attribute__((target("ssse3")))
+static inline __m128i base64_encode_translate_ssse3(__m128i indices) {
+    const __m128i offset_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(offset_lut, range));
+}
+
+// Reads 16 bytes for every 12 encoded, so it stops a block early.
+__attribute__((target("ssse3")))
+static size_t base64_encode_kernel_ssse3(const char* in, size_t length, char* out) {
+    const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 12) {
+        __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i)), spread);
+        __m128i a = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i b = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        _mm_storeu_si128((__m128i*)out, base64_encode_translate_ssse3(_mm_or_si128(a, b)));
+        out += 16;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_encode_kernel_avx2(const char* in, size_t length, char* out) {
+    const __m256i spread = _mm256_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offset_lut = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    size_t i = 0;
+    for (; i + 28 <= length; i += 24) {
+        // each lane gets 12 bytes
+        __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i*)(in + i))),
+                _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        bytes = _mm256_shuffle_epi8(bytes, spread);
+        __m256i a = _mm256_mulhi_epu16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i b = _mm256_mullo_epi16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(a, b);
+
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i is_upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range = _mm256_or_si256(range, _mm256_and_si256(is_upper, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i*)out, _mm256_add_epi8(indices, _mm256_shuffle_epi8(offset_lut, range)));
+        out += 32;
+    }
+
+    return i + base64_encode_kernel_ssse3(in + i, length - i, out);
+}
+
+#endif
+
+static base64_encode_kernel_t base64_select_encode_kernel() {
+    #if BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return base64_encode_kernel_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return base64_encode_kernel_ssse3;
+    #endif
+    return base64_encode_kernel_scalar;
+}
+
+static const base64_encode_kernel_t base64_encode_kernel = base64_select_encode_kernel();
+
+// Returns the number of characters base64_encode() writes for input of the
+// given length.
+static inline size_t base64_encoded_size(size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+// Encodes base64 with padding and without line breaks. Returns the number
+// of characters written.
+static size_t base64_encode(const char* in, size_t length, char* out) {
+    const char* out_start = out;
+
+    size_t i = base64_encode_kernel(in, length, out);
+    out += i / 3 * 4;
+
+    for (; i + 3 <= length; i += 3) {
+        uint32_t bits = ((uint32_t)(uint8_t)in[i] << 16) | ((uint32_t)(uint8_t)in[i + 1] << 8) | (uint8_t)in[i + 2];
+        out[0] = base64_encode_table[bits >> 18];
+        out[1] = base64_encode_table[(bits >> 12) & 0x3f];
+        out[2] = base64_encode_table[(bits >> 6) & 0x3f];
+        out[3] = base64_encode_table[bits & 0x3f];
+        out += 4;
+    }
+
+    if (i + 1 == length) {
+        uint32_t bits = (uint32_t)(uint8_t)in[i] << 16;
+        out[0] = base64_encode_table[bits >> 18];
+        out[1] = base64_encode_table[(bits >> 12) & 0x3f];
+        out[2] = '=';
+        out[3] = '=';
+        out += 4;
+    } else if (i + 2 == length) {
+        uint32_t bits = ((uint32_t)(uint8_t)in[i] << 16) | ((uint32_t)(uint8_t)in[i + 1] << 8);
+        out[0] = base64_encode_table[bits >> 18];
+        out[1] = base64_encode_table[(bits >> 12) & 0x3f];
+        out[2] = base64_encode_table[(bits >> 6) & 0x3f];
+        out[3] = '=';
+        out += 4;
+    }
+
+    return (size_t)(out - out_start);
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_BATCH_H
+#define MSGPACK_TOOLS_BATCH_H 1
+
+// Batch mode converts many files in one process, for when the cost of
+// starting a process per file would dominate. The inputs are given as
+// arguments or as a list on stdin (-L), and each output filename is made from
+// its input filename with a template (-O.) A pool of worker threads takes
+// files from the list in order and converts each one serially.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+// Converts a single file. worker is the index of the calling worker thread,
+// for the tool to find its buffers to reuse.
+typedef bool (*batch_convert_t)(void* context, size_t worker, const char* in_filename, const char* out_filename);
+
+typedef struct batch_t {
+    char** inputs;
+    char** outputs; // made by batch_make_outputs()
+    size_t count;
+    size_t capacity;
+
+    // set while running
+    batch_convert_t convert;
+    void* context;
+    size_t next;   // index of the next input to convert
+    bool failed;
+} batch_t;
+
+static bool batch_add(batch_t* batch, const char* filename, size_t length) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+        char** inputs = (char**)realloc(batch->inputs, capacity * sizeof(char*));
+        if (!inputs)
+            return false;
+        batch->inputs = inputs;
+        batch->capacity = capacity;
+    }
+    char* copy = (char*)malloc(length + 1);
+    if (!copy)
+        return false;
+    memcpy(copy, filename, length);
+    copy[length] = '\0';
+    batch->inputs[batch->count++] = copy;
+    return true;
+}
+
+// Adds the filenames listed in the file, one per line. Empty lines are
+// ignored.
+static bool batch_read_list(batch_t* batch, FILE* file) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    bool ok = true;
+    while (ok && (length = getline(&line, &capacity, file)) != -1) {
+        if (length > 0 && line[length - 1] == '\n')
+            --length;
+        if (length > 0 && line[length - 1] == '\r')
+            --length;
+        if (length > 0)
+            ok = batch_add(batch, line, (size_t)length);
+    }
+    free(line);
+    return ok && !ferror(file);
+}
+
+static void batch_destroy(batch_t* batch) {
+    for (size_t i = 0; i < batch->count; ++i) {
+        free(batch->inputs[i]);
+        if (batch->outputs)
+            free(batch->outputs[i]);
+    }
+    free(batch->inputs);
+    free(batch->outputs);
+}
+
+// Returns true if the output template is valid: it must contain %s or %n so
+// that each input gets its own output, and % may only be followed by s, n or
+// another %.
+static bool batch_check_template(const char* output_template) {
+    bool named = false;
+    for (const char* p = output_template; *p; ++p) {
+        if (*p != '%')
+            continue;
+        ++p;
+        if (*p == 's' || *p == 'n')
+            named = true;
+        else if (*p != '%')
+            return false;
+    }
+    return named;
+}
+
+// Makes the output filename for an input in name (NUL-terminated.) In the
+// template, %s is the input filename without its extension, %n is the same
+// without its directory, and %% is a literal %.
+static bool batch_output_name(const char* output_template, const char* input, buffer_t* name) {
+    const char* base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    const char* extension = strrchr(base, '.');
+    const char* stem_end = (extension && extension != base) ? extension : base + strlen(base);
+
+    name->size = 0;
+    for (const char* p = output_template; *p; ++p) {
+        bool ok;
+        if (*p != '%') {
+            ok = buffer_append(name, p, 1);
+        } else if (*++p == 's') {
+            ok = buffer_append(name, input, (size_t)(stem_end - input));
+        } else if (*p == 'n') {
+            ok = buffer_append(name, base, (size_t)(stem_end - base));
+        } else {
+            ok = buffer_append(name, "%", 1);
+        }
+        if (!ok)
+            return false;
+    }
+    return buffer_append(name, "", 1);
+}
+
+typedef struct batch_name_t {
+    const char* name;
+    size_t index; // of the input
+    bool output;
+} batch_name_t;
+
+// Sorts by name, with an input before the outputs of the same name and
+// otherwise in input order, so that the collision reported is the first one.
+static int batch_compare_names(const void* left, const void* right) {
+    const batch_name_t* a = (const batch_name_t*)left;
+    const batch_name_t* b = (const batch_name_t*)right;
+    int order = strcmp(a->name, b->name);
+    if (order != 0)
+        return order;
+    if (a->output != b->output)
+        return a->output ? 1 : -1;
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+// Makes the output filename of every input, and checks that no two inputs
+// have the same output and that no output is an input, since converting
+// would then overwrite a file that may not have been read yet. Filenames are
+// compared as given, so different paths to the same file are not caught.
+// The check is skipped if nothing will be written (with -V.) Errors are
+// reported under the command's name.
+static bool batch_make_outputs(batch_t* batch, const char* command, const char* output_template, bool check) {
+    size_t slots = batch->count ? batch->count : 1; // malloc(0) may return NULL
+    batch->outputs = (char**)calloc(slots, sizeof(char*));
+    batch_name_t* names = (batch_name_t*)malloc(slots * 2 * sizeof(batch_name_t));
+    buffer_t name = {NULL, 0, 0};
+    bool ok = batch->outputs && names;
+    for (size_t i = 0; ok && i < batch->count; ++i) {
+        ok = batch_output_name(output_template, batch->inputs[i], &name);
+        if (ok) {
+            batch->outputs[i] = (char*)malloc(name.size);
+            ok = batch->outputs[i] != NULL;
+        }
+        if (ok)
+            memcpy(batch->outputs[i], name.data, name.size);
+    }
+    buffer_destroy(&name);
+    if (!ok) {
+        fprintf(stderr, "%s: allocation failure\n", command);
+        free(names);
+        return false;
+    }
+    if (!check) {
+        free(names);
+        return true;
+    }
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        batch_name_t input = {batch->inputs[i], i, false};
+        batch_name_t output = {batch->outputs[i], i, true};
+        names[i * 2] = input;
+        names[i * 2 + 1] = output;
+    }
+    qsort(names, batch->count * 2, sizeof(batch_name_t), batch_compare_names);
+
+    for (size_t i = 1; ok && i < batch->count * 2; ++i) {
+        const batch_name_t* a = &names[i - 1];
+        const batch_name_t* b = &names[i];
+        if (!b->output || strcmp(a->name, b->name) != 0)
+            continue;
+        if (a->output)
+            fprintf(stderr, "%s: \"%s\" and \"%s\" would both be converted to \"%s\"\n", command,
+                    batch->inputs[a->index], batch->inputs[b->index], b->name);
+        else
+            fprintf(stderr, "%s: \"%s\" would be converted to \"%s\", which is an input\n", command,
+                    batch->inputs[b->index], b->name);
+        ok = false;
+    }
+    free(names);
+    return ok;
+}
+
+typedef struct batch_worker_t {
+    batch_t* batch;
+    size_t index;
+    pthread_t thread;
+} batch_worker_t;
+
+static void* batch_worker(void* arg) {
+    batch_worker_t* worker = (batch_worker_t*)arg;
+    batch_t* batch = worker->batch;
+
+    while (true) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count)
+            break;
+        if (!batch->convert(batch->context, worker->index, batch->inputs[i], batch->outputs[i]))
+            __atomic_store_n(&batch->failed, true, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+// Converts all inputs to their outputs on the given number of threads.
+// batch_make_outputs() must have succeeded first. Conversion continues past
+// files that fail; returns false if any did.
+static bool batch_run(batch_t* batch, size_t threads, batch_convert_t convert, void* context) {
+    batch->convert = convert;
+    batch->context = context;
+    batch->next = 0;
+    batch->failed = false;
+
+    if (threads > batch->count)
+        threads = batch->count;
+    if (threads <= 1) {
+        batch_worker_t worker = {batch, 0, pthread_t()};
+        batch_worker(&worker);
+        return !batch->failed;
+    }
+
+    batch_worker_t* workers = (batch_worker_t*)calloc(threads, sizeof(batch_worker_t));
+    if (!workers)
+        return false;
+    size_t started = 0;
+    for (; started < threads; ++started) {
+        workers[started].batch = batch;
+        workers[started].index = started;
+        if (pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started]) != 0)
+            break;
+    }
+
+    // If not all threads could be started, the ones that did take up the
+    // slack. If none did, this thread does all the work.
+    if (started == 0) {
+        batch_worker(&workers[0]);
+    } else {
+        for (size_t i = 0; i < started; ++i)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    return !batch->failed;
+}
+
+#endif
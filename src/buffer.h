@@ -0,0 +1,249 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSGPACK_TOOLS_BUFFER_H
+#define MSGPACK_TOOLS_BUFFER_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asyncio.h"
+#include "stats.h"
+
+// A growable byte buffer.
+typedef struct buffer_t {
+    char* data;
+    size_t size;
+    size_t capacity;
+} buffer_t;
+
+// Ensures there is room for at least extra more bytes. Returns false on
+// allocation failure.
+static inline bool buffer_reserve(buffer_t* buffer, size_t extra) {
+    if (buffer->capacity - buffer->size >= extra)
+        return true;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->size < extra)
+        capacity *= 2;
+    char* data = (char*)realloc(buffer->data, capacity);
+    if (!data)
+        return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static inline bool buffer_append(buffer_t* buffer, const char* data, size_t size) {
+    if (!buffer_reserve(buffer, size))
+        return false;
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+// Returns space for at least size bytes, discarding the contents of the
+// buffer. This lets a buffer serve as scratch space that is reused for each
+// value rather than allocating and freeing for each one. Returns NULL on
+// allocation failure.
+static inline char* buffer_scratch(buffer_t* buffer, size_t size) {
+    buffer->size = 0;
+    if (!buffer_reserve(buffer, size ? size : 1))
+        return NULL;
+    return buffer->data;
+}
+
+static inline void buffer_destroy(buffer_t* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+// A rapidjson output stream that appends to a buffer_t. rapidjson can't
+// handle errors from a stream, so an allocation failure sets the error flag
+// and further output is dropped.
+struct BufferStream {
+    typedef char Ch;
+
+    buffer_t* buffer;
+    bool error;
+
+    explicit BufferStream(buffer_t* buffer) : buffer(buffer), error(false) {}
+
+    void Put(Ch c) {
+        if (buffer->size == buffer->capacity && !Grow(1))
+            return;
+        buffer->data[buffer->size++] = c;
+    }
+
+    void Write(const Ch* data, size_t size) {
+        if (buffer->capacity - buffer->size < size && !Grow(size))
+            return;
+        memcpy(buffer->data + buffer->size, data, size);
+        buffer->size += size;
+    }
+
+    bool Grow(size_t extra) {
+        if (!error && buffer_reserve(buffer, extra))
+            return true;
+        error = true;
+        return false;
+    }
+
+    void Flush() {}
+
+    // Nothing to flush; the output is already in memory.
+    void FlushFile() {}
+
+    // not implemented; the stream is write-only
+    Ch Peek() const {RAPIDJSON_ASSERT(false); return 0;}
+    Ch Take() {RAPIDJSON_ASSERT(false); return 0;}
+    size_t Tell() const {RAPIDJSON_ASSERT(false); return 0;}
+    Ch* PutBegin() {RAPIDJSON_ASSERT(false); return 0;}
+    size_t PutEnd(Ch*) {RAPIDJSON_ASSERT(false); return 0;}
+};
+
+// Writes output somewhere other than a file. Returns false on error.
+typedef bool (*write_callback_t)(void* context, const char* data, size_t size);
+
+// A rapidjson output stream that writes to a file through a buffer. Unlike
+// rapidjson's FileWriteStream, it can write runs of bytes in bulk, and it
+// records write errors in its error flag. If stats is not NULL, it counts the
+// bytes written and the time spent writing them.
+//
+// If async is not NULL, the buffer is a block of an async writer, and each
+// flush hands it off to the writer thread in exchange for the next block.
+//
+// If callback is not NULL, the buffer is passed to it instead of being written
+// to a file.
+//
+// Once a write has failed, further output is dropped.
+struct FileStream {
+    typedef char Ch;
+
+    FILE* file;
+    char* buffer;
+    size_t size;
+    size_t capacity;
+    bool error;
+    stats_t* stats;
+    async_writer_t* async;
+    write_callback_t callback;
+    void* context;
+
+    FileStream(FILE* file, char* buffer, size_t capacity, stats_t* stats = NULL)
+        : file(file), buffer(buffer), size(0), capacity(capacity), error(false), stats(stats), async(NULL),
+          callback(NULL), context(NULL) {}
+
+    FileStream(async_writer_t* async, stats_t* stats = NULL)
+        : file(async->file), buffer(async_writer_buffer(async)), size(0), capacity(async->block_size),
+          error(false), stats(stats), async(async), callback(NULL), context(NULL) {}
+
+    FileStream(write_callback_t callback, void* context, char* buffer, size_t capacity)
+        : file(NULL), buffer(buffer), size(0), capacity(capacity), error(false), stats(NULL), async(NULL),
+          callback(callback), context(context) {}
+
+    void Put(Ch c) {
+        if (error)
+            return;
+        if (size == capacity)
+            Flush();
+        buffer[size++] = c;
+    }
+
+    void Write(const Ch* data, size_t count) {
+        if (error)
+            return;
+        if (capacity - size < count) {
+            Flush();
+
+            // large runs are written directly, or in whole blocks if async
+            if (count >= capacity && !async) {
+                WriteFile(data, count);
+                return;
+            }
+            while (count >= capacity) {
+                memcpy(buffer, data, capacity);
+                size = capacity;
+                Flush();
+                data += capacity;
+                count -= capacity;
+            }
+        }
+        memcpy(buffer + size, data, count);
+        size += count;
+    }
+
+    void Flush() {
+        if (size > 0 && !error) {
+            if (async)
+                SubmitBlock();
+            else
+                WriteFile(buffer, size);
+        }
+        size = 0;
+    }
+
+    // Flushes the buffer and the file's own stdio buffer, so that everything
+    // written so far reaches the output.
+    void FlushFile() {
+        Flush();
+        double start = stats ? stats_now() : 0;
+        if (async && !async_writer_sync(async))
+            error = true;
+        if (file && fflush(file) != 0)
+            error = true;
+        if (stats)
+            stats->write_seconds += stats_now() - start;
+    }
+
+    void SubmitBlock() {
+        double start = stats ? stats_now() : 0;
+        buffer = async_write(async, size);
+        if (stats) {
+            stats->write_seconds += stats_now() - start;
+            stats->bytes_out += size;
+        }
+    }
+
+    void WriteFile(const Ch* data, size_t count) {
+        double start = stats ? stats_now() : 0;
+        if (callback ? !callback(context, data, count) : fwrite(data, 1, count, file) != count)
+            error = true;
+        if (stats) {
+            stats->write_seconds += stats_now() - start;
+            stats->bytes_out += count;
+        }
+    }
+
+    // not implemented; the stream is write-only
+    Ch Peek() const {RAPIDJSON_ASSERT(false); return 0;}
+    Ch Take() {RAPIDJSON_ASSERT(false); return 0;}
+    size_t Tell() const {RAPIDJSON_ASSERT(false); return 0;}
+    Ch* PutBegin() {RAPIDJSON_ASSERT(false); return 0;}
+    size_t PutEnd(Ch*) {RAPIDJSON_ASSERT(false); return 0;}
+};
+
+#endif
@@ -29,6 +29,9 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "rapidjson/error/en.h"
 
@@ -65,24 +68,49 @@
         #endif
     #pragma GCC diagnostic pop
 
-    #pragma GCC diagnostic push
-        // libb64 has switch case fallthroughs.
-        #pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
-        #include "cdecode.c"
-        #include "cencode.c"
-    #pragma GCC diagnostic pop
-
-    #include "rapidjson/filewritestream.h"
+    #include "rapidjson/memorystream.h"
     #include "rapidjson/prettywriter.h"
+    #include "rapidjson/reader.h"
     #include "rapidjson/writer.h"
-    #pragma GCC diagnostic push
-        // rapidjson copies classes with memcpy.
-        #pragma GCC diagnostic ignored "-Wclass-memaccess"
-        #include "rapidjson/document.h"
-    #pragma GCC diagnostic pop
 
 #pragma GCC diagnostic pop
 
 #define BUFFER_SIZE 65536
 
+// A read-only memory mapping of an input file.
+typedef struct mapped_file_t {
+    char* data;
+    size_t size;
+} mapped_file_t;
+
+// Maps the given file into memory for sequential reading. Returns false if
+// the file is empty, is not a regular file (e.g. a pipe or terminal) or
+// cannot be mapped, in which case the caller should fall back to reading
+// it as a stream.
+static bool map_file(const char* filename, mapped_file_t* file) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    file->data = (char*)data;
+    file->size = (size_t)st.st_size;
+    return true;
+}
+
+static void unmap_file(mapped_file_t* file) {
+    munmap(file->data, file->size);
+}
+
 #endif
@@ -0,0 +1,159 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSGPACK_TOOLS_ESCAPE_H
+#define MSGPACK_TOOLS_ESCAPE_H 1
+
+// JSON string escaping. The output matches that of rapidjson's writers so
+// that we can write strings ourselves without changing the output.
+//
+// Most strings need little or no escaping, so we scan for the bytes that do
+// with SIMD kernels for x86, selected at runtime based on the features of the
+// CPU, and write the runs between them to the output stream in bulk.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define ESCAPE_X86 1
+    #include <immintrin.h>
+#else
+    #define ESCAPE_X86 0
+#endif
+
+// The character following the backslash for each byte that needs escaping,
+// or 0 if the byte is written as-is. 'u' means the byte is written as a
+// \u00XX escape.
+static const char json_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+      0,   0, '"',   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,'\\',   0,   0,   0,
+};
+
+// A scan kernel returns the number of bytes at the start of the data that
+// need no escaping. It only looks at whole blocks; if it returns a multiple of
+// the block size, the bytes after it still need to be checked.
+typedef size_t (*json_scan_kernel_t)(const char* data, size_t length);
+
+static size_t json_scan_kernel_scalar(const char* data, size_t length) {
+    return 0;
+}
+
+#if ESCAPE_X86
+
+// Returns a mask of the bytes that need escaping: quotes, backslashes, and
+// control characters (anything up to 0x1F, compared unsigned.)
+__attribute__((target("sse2")))
+static inline __m128i json_escape_mask_sse2(__m128i bytes) {
+    __m128i quote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'));
+    __m128i backslash = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'));
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(0x1F)), bytes);
+    return _mm_or_si128(_mm_or_si128(quote, backslash), control);
+}
+
+__attribute__((target("sse2")))
+static size_t json_scan_kernel_sse2(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(json_escape_mask_sse2(bytes));
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_kernel_avx2(const char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i quote = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"'));
+        __m256i backslash = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\'));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, _mm256_set1_epi8(0x1F)), bytes);
+        __m256i escape = _mm256_or_si256(_mm256_or_si256(quote, backslash), control);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(escape);
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+
+    // finish with a 16-byte block if we can
+    if (i + 16 <= length) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(json_escape_mask_sse2(bytes));
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+        i += 16;
+    }
+    return i;
+}
+
+#endif
+
+static json_scan_kernel_t json_select_scan_kernel() {
+    #if ESCAPE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return json_scan_kernel_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return json_scan_kernel_sse2;
+    #endif
+    return json_scan_kernel_scalar;
+}
+
+static const json_scan_kernel_t json_scan_kernel = json_select_scan_kernel();
+
+// Writes the escaped contents of a string (without quotes) to an output
+// stream. The stream must support Write() for runs of bytes.
+template <class StreamType>
+static void json_escape(StreamType& stream, const char* data, size_t length) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    const char* end = data + length;
+
+    while (data != end) {
+        size_t run = json_scan_kernel(data, (size_t)(end - data));
+        while (data + run != end && !json_escape_table[(uint8_t)data[run]])
+            ++run;
+        stream.Write(data, run);
+        data += run;
+        if (data == end)
+            break;
+
+        uint8_t c = (uint8_t)*data++;
+        char escape = json_escape_table[c];
+        stream.Put('\\');
+        stream.Put(escape);
+        if (escape == 'u') {
+            stream.Put('0');
+            stream.Put('0');
+            stream.Put(hex_digits[c >> 4]);
+            stream.Put(hex_digits[c & 0xf]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_HISTOGRAM_H
+#define MSGPACK_TOOLS_HISTOGRAM_H 1
+
+// A log-linear histogram of non-negative integers, in the style of
+// HdrHistogram. Each power of two is split into HISTOGRAM_SUB_BUCKETS
+// buckets, so a recorded value is known to within about 3% regardless of its
+// magnitude. Values below HISTOGRAM_SUB_BUCKETS are recorded exactly, and
+// values of HISTOGRAM_MAX_BITS bits or more land in the last bucket.
+//
+// Recording a value is a count leading zeros, a shift and an increment.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 48
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static inline size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (size_t)value;
+    if (value >= (uint64_t)1 << HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    int shift = (63 - __builtin_clzll(value)) - HISTOGRAM_SUB_BITS;
+    return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+// Returns the largest value that lands in the given bucket.
+static inline uint64_t histogram_bucket_max(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t top = HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static inline void histogram_record(histogram_t* histogram, uint64_t value) {
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    ++histogram->count;
+    histogram->sum += value;
+    ++histogram->buckets[histogram_index(value)];
+}
+
+static inline void histogram_add(histogram_t* total, const histogram_t* other) {
+    if (other->count == 0)
+        return;
+    if (total->count == 0 || other->min < total->min)
+        total->min = other->min;
+    if (other->max > total->max)
+        total->max = other->max;
+    total->count += other->count;
+    total->sum += other->sum;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        total->buckets[i] += other->buckets[i];
+}
+
+// Returns the value at the given percentile (0 to 100.) As with
+// HdrHistogram, this is the largest value of the bucket it falls in, so it
+// may overestimate slightly; it is never more than the maximum recorded.
+static uint64_t histogram_percentile(const histogram_t* histogram, double percentile) {
+    if (histogram->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static const double histogram_percentiles[] = {50, 90, 99, 99.9, 99.99};
+static const char* const histogram_percentile_names[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+#define HISTOGRAM_PERCENTILES (sizeof(histogram_percentiles) / sizeof(*histogram_percentiles))
+
+// Prints a summary of the histogram as the members of a JSON object, with
+// values divided by scale.
+static void histogram_print_json(FILE* file, const histogram_t* histogram, double scale) {
+    fprintf(file, "\"count\":%llu,\"min\":%.3f,\"mean\":%.3f", (unsigned long long)histogram->count,
+            (double)histogram->min / scale,
+            histogram->count ? (double)histogram->sum / (double)histogram->count / scale : 0.0);
+    for (size_t i = 0; i < HISTOGRAM_PERCENTILES; ++i)
+        fprintf(file, ",\"%s\":%.3f", histogram_percentile_names[i],
+                (double)histogram_percentile(histogram, histogram_percentiles[i]) / scale);
+    fprintf(file, ",\"max\":%.3f", (double)histogram->max / scale);
+}
+
+// Prints a summary of the histogram on one line, with values divided by
+// scale.
+static void histogram_print_text(FILE* file, const histogram_t* histogram, double scale) {
+    fprintf(file, "count %llu, min %.3f, mean %.3f", (unsigned long long)histogram->count,
+            (double)histogram->min / scale,
+            histogram->count ? (double)histogram->sum / (double)histogram->count / scale : 0.0);
+    for (size_t i = 0; i < HISTOGRAM_PERCENTILES; ++i)
+        fprintf(file, ", %s %.3f", histogram_percentile_names[i],
+                (double)histogram_percentile(histogram, histogram_percentiles[i]) / scale);
+    fprintf(file, ", max %.3f\n", (double)histogram->max / scale);
+}
+
+#endif
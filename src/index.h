@@ -0,0 +1,272 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_INDEX_H
+#define MSGPACK_TOOLS_INDEX_H 1
+
+// Record indexes for msgpack2json in continuous mode (-I and -r.)
+//
+// An index holds the byte offset of every INDEX_STRIDEth top-level element
+// of a MessagePack file, along with the number of elements. To find a record
+// we start from the nearest offset at or before it and skip the rest of the
+// way with MPack, so the index stays small (8 bytes per INDEX_STRIDE
+// records) while a lookup skips no more than INDEX_STRIDE - 1 records.
+//
+// The index file is INDEX_MAGIC followed by little-endian 64-bit integers:
+// the size, modification time (seconds and nanoseconds), device and inode of
+// the input when it was indexed, the record count, the stride, the number of
+// offsets, and the offsets. An index that doesn't match all of these for its
+// input is stale.
+
+#include "common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INDEX_STRIDE 64
+#define INDEX_MAGIC "MPTIDX02"
+#define INDEX_HEADER_SIZE (8 + 8 * 8)
+
+#ifdef __APPLE__
+#define INDEX_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define INDEX_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+typedef struct index_t {
+    uint64_t input_size;
+    uint64_t input_mtime;
+    uint64_t input_mtime_nsec;
+    uint64_t input_device;
+    uint64_t input_inode;
+    uint64_t count;
+    uint64_t stride;
+    uint64_t* offsets; // (count + stride - 1) / stride of them
+} index_t;
+
+// A range of records [first, last) given with -r
+typedef struct record_range_t {
+    uint64_t first;
+    uint64_t last; // UINT64_MAX for the end of the input
+} record_range_t;
+
+// Parses a range of records: "n" for record n alone, "a:b" for records a up
+// to but not including b, and "a:" or ":b" for ranges open at either end.
+// Records are numbered from 0.
+static bool index_parse_range(const char* arg, record_range_t* range) {
+    const char* colon = strchr(arg, ':');
+    char* end;
+    range->first = 0;
+    range->last = UINT64_MAX;
+
+    if (arg[0] != ':') {
+        if (arg[0] < '0' || arg[0] > '9')
+            return false;
+        errno = 0;
+        range->first = strtoull(arg, &end, 10);
+        if (errno != 0 || end != (colon ? colon : arg + strlen(arg)))
+            return false;
+    }
+    if (!colon) {
+        if (range->first == UINT64_MAX)
+            return false;
+        range->last = range->first + 1;
+        return true;
+    }
+    if (colon[1] != '\0') {
+        if (colon[1] < '0' || colon[1] > '9')
+            return false;
+        errno = 0;
+        range->last = strtoull(colon + 1, &end, 10);
+        if (errno != 0 || *end != '\0')
+            return false;
+    }
+    return range->first <= range->last;
+}
+
+// Skips up to count top-level elements of the data from the given offset,
+// stopping early at the end of the data. Returns false on a parse error.
+static bool index_skip(const char* data, size_t size, size_t offset, uint64_t count, size_t* result) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, data + offset, size - offset);
+    const char* remaining_data;
+    for (uint64_t i = 0; i < count && mpack_reader_remaining(&reader, &remaining_data) > 0; ++i)
+        mpack_discard(&reader);
+    *result = size - mpack_reader_remaining(&reader, &remaining_data);
+    return mpack_reader_destroy(&reader) == mpack_ok;
+}
+
+// Indexes the records of the data, the contents of the file with the given
+// status. Returns false on a parse error or allocation failure.
+static bool index_build(index_t* index, const char* data, size_t size, const struct stat* st) {
+    memset(index, 0, sizeof(*index));
+    index->input_size = (uint64_t)st->st_size;
+    index->input_mtime = (uint64_t)st->st_mtime;
+    index->input_mtime_nsec = (uint64_t)INDEX_MTIME_NSEC(st);
+    index->input_device = (uint64_t)st->st_dev;
+    index->input_inode = (uint64_t)st->st_ino;
+    index->stride = INDEX_STRIDE;
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, data, size);
+    size_t capacity = 0;
+    const char* remaining_data;
+    while (mpack_reader_remaining(&reader, &remaining_data) > 0) {
+        if (index->count % index->stride == 0) {
+            size_t used = (size_t)(index->count / index->stride);
+            if (used == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                uint64_t* offsets = (uint64_t*)realloc(index->offsets, capacity * sizeof(uint64_t));
+                if (!offsets) {
+                    mpack_reader_destroy(&reader);
+                    return false;
+                }
+                index->offsets = offsets;
+            }
+            index->offsets[used] = size - mpack_reader_remaining(&reader, &remaining_data);
+        }
+        mpack_discard(&reader);
+        if (mpack_reader_error(&reader) != mpack_ok)
+            break;
+        ++index->count;
+    }
+    return mpack_reader_destroy(&reader) == mpack_ok;
+}
+
+static void index_destroy(index_t* index) {
+    free(index->offsets);
+    index->offsets = NULL;
+}
+
+// A file rewritten in place within the same second and at the same size
+// still has a different modification time in nanoseconds on most file
+// systems, and one replaced by rename has a different inode.
+static bool index_matches(const index_t* index, const struct stat* st) {
+    return index->input_size == (uint64_t)st->st_size && index->input_mtime == (uint64_t)st->st_mtime &&
+            index->input_mtime_nsec == (uint64_t)INDEX_MTIME_NSEC(st) &&
+            index->input_device == (uint64_t)st->st_dev && index->input_inode == (uint64_t)st->st_ino;
+}
+
+// This can't overflow for any count read from a file.
+static inline uint64_t index_offset_count(const index_t* index) {
+    return index->count / index->stride + (index->count % index->stride != 0);
+}
+
+static void index_put_u64(char* p, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+        p[i] = (char)(value >> (8 * i));
+}
+
+static uint64_t index_get_u64(const char* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (uint64_t)(uint8_t)p[i] << (8 * i);
+    return value;
+}
+
+static bool index_write(const index_t* index, const char* filename) {
+    size_t offsets = (size_t)index_offset_count(index);
+    size_t size = INDEX_HEADER_SIZE + offsets * 8;
+    char* data = (char*)malloc(size);
+    if (!data)
+        return false;
+    memcpy(data, INDEX_MAGIC, 8);
+    index_put_u64(data + 8, index->input_size);
+    index_put_u64(data + 16, index->input_mtime);
+    index_put_u64(data + 24, index->input_mtime_nsec);
+    index_put_u64(data + 32, index->input_device);
+    index_put_u64(data + 40, index->input_inode);
+    index_put_u64(data + 48, index->count);
+    index_put_u64(data + 56, index->stride);
+    index_put_u64(data + 64, (uint64_t)offsets);
+    for (size_t i = 0; i < offsets; ++i)
+        index_put_u64(data + INDEX_HEADER_SIZE + i * 8, index->offsets[i]);
+
+    FILE* file = fopen(filename, "wb");
+    bool ok = file && fwrite(data, 1, size, file) == size;
+    if (file && fclose(file) != 0)
+        ok = false;
+    free(data);
+    return ok;
+}
+
+// Reads an index. Returns false if the file doesn't exist or isn't a valid
+// index. Everything is checked so that a corrupt index can't make
+// index_seek() read out of bounds: the stride must be ours, there can't be
+// more records than bytes, and the offsets must start at 0 and increase
+// within the input.
+static bool index_read(index_t* index, const char* filename) {
+    memset(index, 0, sizeof(*index));
+    mapped_file_t mapped;
+    if (!map_file(filename, &mapped))
+        return false;
+
+    bool ok = mapped.size >= INDEX_HEADER_SIZE && memcmp(mapped.data, INDEX_MAGIC, 8) == 0;
+    if (ok) {
+        index->input_size = index_get_u64(mapped.data + 8);
+        index->input_mtime = index_get_u64(mapped.data + 16);
+        index->input_mtime_nsec = index_get_u64(mapped.data + 24);
+        index->input_device = index_get_u64(mapped.data + 32);
+        index->input_inode = index_get_u64(mapped.data + 40);
+        index->count = index_get_u64(mapped.data + 48);
+        index->stride = index_get_u64(mapped.data + 56);
+        uint64_t offsets = index_get_u64(mapped.data + 64);
+        ok = index->stride == INDEX_STRIDE && index->count <= index->input_size &&
+                offsets == index_offset_count(index) &&
+                offsets == (mapped.size - INDEX_HEADER_SIZE) / 8 &&
+                (mapped.size - INDEX_HEADER_SIZE) % 8 == 0;
+    }
+    if (ok && index->count > 0) {
+        size_t offsets = (size_t)index_offset_count(index);
+        index->offsets = (uint64_t*)malloc(offsets * sizeof(uint64_t));
+        ok = index->offsets != NULL;
+        for (size_t i = 0; ok && i < offsets; ++i) {
+            index->offsets[i] = index_get_u64(mapped.data + INDEX_HEADER_SIZE + i * 8);
+            ok = index->offsets[i] < index->input_size &&
+                    (i == 0 ? index->offsets[i] == 0 : index->offsets[i] > index->offsets[i - 1]);
+        }
+    }
+
+    unmap_file(&mapped);
+    if (!ok)
+        index_destroy(index);
+    return ok;
+}
+
+// Finds the offset of the given record in the indexed data, or the size of
+// the data if it is past the end. Returns false on a parse error.
+static bool index_seek(const index_t* index, const char* data, size_t size, uint64_t record, size_t* offset) {
+    if (record >= index->count) {
+        *offset = size;
+        return true;
+    }
+    return index_skip(data, size, (size_t)index->offsets[record / index->stride], record % index->stride, offset);
+}
+
+#endif
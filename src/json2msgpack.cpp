@@ -23,6 +23,10 @@
  */
 
 #include "common.h"
+#include "base64.h"
+#include "batch.h"
+#include "number.h"
+#include "parallel.h"
 #include <ctype.h>
 #include <errno.h>
 
@@ -36,41 +40,57 @@ typedef struct options_t {
     bool use_float;
     bool base64_prefix;
     size_t base64_min_bytes;
+    size_t threads;
+    stats_mode_t stats;
+    bool histogram;
+    bool unbuffered;
+    const char* output_template; // batch mode, with input files or -L
+    bool file_list;
+    struct workspace_t* workspace;
+    bool validate; // -V
+    FILE* error_file; // conversion errors go here if not NULL
 } options_t;
 
+// Returns the stream conversion errors are reported to. Parallel jobs capture
+// theirs so that only the first failed job's errors are printed.
+static FILE* error_output(options_t* options) {
+    return options->error_file ? options->error_file : stderr;
+}
+
+// Buffers kept by each batch mode worker and reused for every file it
+// converts.
+typedef struct workspace_t {
+    char* buffer;
+    buffer_t scratch;
+    stats_t stats; // counters of the file being converted
+} workspace_t;
+
 static const char* prefix_ext    = "ext:";
 static const char* prefix_base64 = "base64:";
 
-// libb64 doesn't have the means to return errors on invalid characters, so
-// for base64 detection, we manually scan the string for invalid characters.
+// Decodes base64 into the scratch buffer. Returns NULL on allocation failure
+// (which is reported) or if the string contains invalid base64, in which case
+// error_offset is set to the offset of the offending character.
+//
 // For detection we allow CR/LF but we don't allow spaces (otherwise pretty
 // much any normal string would be detected as base64.)
-static bool is_base64(const char* string, size_t length) {
-    for (size_t i = 0; i < length; ++i) {
-        char c = string[i];
-        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
-                || c == '+' || c == '/' || c == '=' || c == '\r' || c == '\n')) {
-            return false;
-        }
-    }
-    return true;
-}
-
-static char* convert_base64(options_t* options, const char* p, size_t len, size_t* out_bytes) {
-    size_t bytes = len * 3 / 4 + 4; // TODO check this
-    char* data = (char*)malloc(bytes);
+static char* convert_base64(options_t* options, buffer_t* scratch, const char* p, size_t len, size_t* out_bytes, size_t* error_offset) {
+    char* data = buffer_scratch(scratch, base64_decoded_size(len));
     if (!data) {
-        fprintf(stderr, "%s: allocation failure\n", options->command);
+        fprintf(error_output(options), "%s: allocation failure\n", options->command);
+        *error_offset = SIZE_MAX;
         return NULL;
     }
-    base64_decodestate state;
-    base64_init_decodestate(&state);
-    bytes = base64_decode_block(p, len, data, &state);
-    *out_bytes = bytes;
+    if (!base64_decode(p, len, data, out_bytes, error_offset))
+        return NULL;
     return data;
 }
 
-static bool write_string(options_t* options, mpack_writer_t* writer, const char* string, size_t length, bool allow_detection) {
+// Writes a string, or bin or ext if it contains base64. If stats is not NULL,
+// the value is counted.
+static bool write_string(options_t* options, mpack_writer_t* writer, buffer_t* scratch, stats_t* stats,
+        const char* string, size_t length, bool allow_detection)
+{
 
     if (options->base64_prefix) {
 
@@ -78,20 +98,22 @@ static bool write_string(options_t* options, mpack_writer_t* writer, const char*
         if (length >= strlen(prefix_base64) && memcmp(string, prefix_base64, strlen(prefix_base64)) == 0) {
             const char* base64_data = string + strlen(prefix_base64);
             size_t base64_len = length - strlen(prefix_base64);
-            if (!is_base64(base64_data, base64_len)) {
-                fprintf(stderr, "%s: string prefixed with \"base64:\" contains invalid base64\n", options->command);
-                return false;
-            }
 
             // write base64
-            size_t count;
-            char* bytes = convert_base64(options, base64_data, base64_len, &count);
-            if (bytes) {
-                mpack_write_bin(writer, bytes, count);
-                free(bytes);
-                return mpack_writer_error(writer) == mpack_ok;
+            size_t count, error_offset;
+            char* bytes = convert_base64(options, scratch, base64_data, base64_len, &count, &error_offset);
+            if (!bytes) {
+                if (error_offset != SIZE_MAX)
+                    fprintf(error_output(options), "%s: string prefixed with \"base64:\" contains invalid base64 at offset %zu\n",
+                            options->command, error_offset + strlen(prefix_base64));
+                return false;
             }
-            return false;
+            mpack_write_bin(writer, bytes, count);
+            if (stats) {
+                ++stats->types[mpack_type_bin];
+                stats->base64_bytes += count;
+            }
+            return mpack_writer_error(writer) == mpack_ok;
         }
 
         // check for ext prefix
@@ -104,191 +126,468 @@ static bool write_string(options_t* options, mpack_writer_t* writer, const char*
             int64_t exttype = strtol(exttype_str, &remainder, 10);
             if (errno != 0 || *(remainder++) != ':' || strlen(remainder) < strlen(prefix_base64)
                     || memcmp(remainder, prefix_base64, strlen(prefix_base64)) != 0) {
-                fprintf(stderr, "\"%s\"\n", remainder);
-                fprintf(stderr, "%s: string prefixed with \"ext:\" contains invalid prefix\n", options->command);
+                fprintf(error_output(options), "\"%s\"\n", remainder);
+                fprintf(error_output(options), "%s: string prefixed with \"ext:\" contains invalid prefix\n", options->command);
                 return false;
             }
             if (exttype < INT8_MIN || exttype > INT8_MAX) {
-                fprintf(stderr, "%s: string prefixed with \"ext:\" has out-of-bounds ext type: %" PRIi64 "\n", options->command, exttype);
+                fprintf(error_output(options), "%s: string prefixed with \"ext:\" has out-of-bounds ext type: %" PRIi64 "\n", options->command, exttype);
                 return false;
             }
 
-            // check base64
+            // write ext
             const char* base64_data = remainder + strlen(prefix_base64);
             size_t base64_len = strlen(base64_data);
-            if (!is_base64(base64_data, base64_len)) {
-                fprintf(stderr, "\"%s\"\n", base64_data);
-                fprintf(stderr, "%s: string prefixed with \"ext:\" contains invalid base64\n", options->command);
+            size_t count, error_offset;
+            char* bytes = convert_base64(options, scratch, base64_data, base64_len, &count, &error_offset);
+            if (!bytes) {
+                if (error_offset != SIZE_MAX)
+                    fprintf(error_output(options), "%s: string prefixed with \"ext:\" contains invalid base64 at offset %zu\n",
+                            options->command, (size_t)(base64_data - string) + error_offset);
                 return false;
             }
-
-            // write ext
-            size_t count;
-            char* bytes = convert_base64(options, base64_data, base64_len, &count);
-            if (bytes) {
-                mpack_write_ext(writer, (int8_t)exttype, bytes, count);
-                free(bytes);
-                return mpack_writer_error(writer) == mpack_ok;
+            mpack_write_ext(writer, (int8_t)exttype, bytes, count);
+            if (stats) {
+                ++stats->types[mpack_type_ext];
+                stats->base64_bytes += count;
             }
-            return false;
+            return mpack_writer_error(writer) == mpack_ok;
         }
 
     }
 
-    // try to parse as base64
-    if (allow_detection && options->base64_min_bytes != 0 && length >= options->base64_min_bytes && is_base64(string, length)) {
-        size_t count;
-        char* bytes = convert_base64(options, string, length, &count);
+    // try to parse as base64. If it isn't valid, we write it as a string.
+    if (allow_detection && options->base64_min_bytes != 0 && length >= options->base64_min_bytes) {
+        size_t count, error_offset;
+        char* bytes = convert_base64(options, scratch, string, length, &count, &error_offset);
         if (bytes) {
             mpack_write_bin(writer, bytes, count);
-            free(bytes);
+            if (stats) {
+                ++stats->types[mpack_type_bin];
+                stats->base64_bytes += count;
+            }
             return mpack_writer_error(writer) == mpack_ok;
         }
-        return false;
+        if (error_offset == SIZE_MAX)
+            return false;
     }
 
     mpack_write_str(writer, string, length);
+    if (stats)
+        ++stats->types[mpack_type_str];
     return mpack_writer_error(writer) == mpack_ok;
 }
 
-static bool write_value(options_t* options, Value& value, mpack_writer_t* writer) {
-    switch (value.GetType()) {
-        case kNullType:   mpack_write_nil(writer);    break;
-        case kTrueType:   mpack_write_true(writer);   break;
-        case kFalseType:  mpack_write_false(writer);  break;
+// A growable array of uint32_t. The SAX conversion uses these for the
+// element counts of arrays and maps, and for the stack of open containers.
+typedef struct counts_t {
+    uint32_t* data;
+    size_t size;
+    size_t capacity;
+} counts_t;
 
-        case kNumberType:
-            if (value.IsDouble()) {
-                if (options->use_float)
-                    mpack_write_float(writer, (float)value.GetDouble());
-                else
-                    mpack_write_double(writer, value.GetDouble());
-            } else if (value.IsUint64()) {
-                mpack_write_u64(writer, value.GetUint64());
-            } else {
-                mpack_write_i64(writer, value.GetInt64());
-            }
-            break;
+static bool counts_push(counts_t* counts, uint32_t value) {
+    if (counts->size == counts->capacity) {
+        size_t capacity = counts->capacity ? counts->capacity * 2 : 64;
+        uint32_t* data = (uint32_t*)realloc(counts->data, capacity * sizeof(uint32_t));
+        if (!data)
+            return false;
+        counts->data = data;
+        counts->capacity = capacity;
+    }
+    counts->data[counts->size++] = value;
+    return true;
+}
 
-        case kStringType:
-            if (!write_string(options, writer, value.GetString(), value.GetStringLength(), true))
-                return false;
-            break;
+// MessagePack needs the element count of each array and map before its
+// contents, but a SAX parser only knows the count when the container closes.
+// We therefore parse each top-level value twice. The first pass uses a
+// CountHandler which records only the container counts, in the order the
+// containers are opened. The second pass uses a WriteHandler which writes
+// directly to the MPack writer, taking counts from the first pass.
+//
+// Memory usage scales with the number of containers in a top-level value (four
+// bytes each) rather than with a full DOM of the document.
 
-        case kArrayType: {
-            mpack_start_array(writer, value.Size());
-            Value::ValueIterator it = value.Begin(), end = value.End();
-            for (; it != end; ++it) {
-                if (!write_value(options, *it, writer))
-                    return false;
-            }
-            mpack_finish_array(writer);
-            break;
+struct CountHandler : public BaseReaderHandler<UTF8<>, CountHandler> {
+    options_t* options;
+    counts_t* counts;
+    counts_t* stack; // indices into counts of containers not yet closed
+
+    CountHandler(options_t* options, counts_t* counts, counts_t* stack)
+        : options(options), counts(counts), stack(stack) {}
+
+    bool StartContainer() {
+        if (!counts_push(stack, (uint32_t)counts->size) || !counts_push(counts, 0)) {
+            fprintf(error_output(options), "%s: allocation failure\n", options->command);
+            return false;
         }
+        return true;
+    }
 
-        case kObjectType: {
-            mpack_start_map(writer, value.MemberCount());
-            Value::MemberIterator it = value.MemberBegin(), end = value.MemberEnd();
-            for (; it != end; ++it) {
-                if (!write_string(options, writer, it->name.GetString(), it->name.GetStringLength(), false))
-                    return false;
-                if (!write_value(options, it->value, writer))
-                    return false;
-            }
-            mpack_finish_map(writer);
-            break;
+    bool EndContainer(SizeType count) {
+        counts->data[stack->data[--stack->size]] = count;
+        return true;
+    }
+
+    bool StartObject() {return StartContainer();}
+    bool EndObject(SizeType count) {return EndContainer(count);}
+    bool StartArray() {return StartContainer();}
+    bool EndArray(SizeType count) {return EndContainer(count);}
+};
+
+// If stats is not NULL, the WriteHandler counts the values it writes by
+// their MessagePack type.
+struct WriteHandler : public BaseReaderHandler<UTF8<>, WriteHandler> {
+    options_t* options;
+    mpack_writer_t* writer;
+    buffer_t* scratch;
+    stats_t* stats;
+    const counts_t* counts;
+    size_t next; // index in counts of the next container to be opened
+
+    WriteHandler(options_t* options, mpack_writer_t* writer, buffer_t* scratch, stats_t* stats, const counts_t* counts)
+        : options(options), writer(writer), scratch(scratch), stats(stats), counts(counts), next(0) {}
+
+    bool ok() {
+        return mpack_writer_error(writer) == mpack_ok;
+    }
+
+    void count(mpack_type_t type) {
+        if (stats)
+            ++stats->types[type];
+    }
+
+    bool Null() {mpack_write_nil(writer); count(mpack_type_nil); return ok();}
+    bool Bool(bool b) {mpack_write_bool(writer, b); count(mpack_type_bool); return ok();}
+
+    // Non-negative integers are written as unsigned to match what a DOM
+    // would report through IsUint64().
+    bool Int(int i) {return Int64(i);}
+    bool Uint(unsigned u) {return Uint64(u);}
+    bool Int64(int64_t i) {
+        if (i >= 0)
+            return Uint64((uint64_t)i);
+        mpack_write_i64(writer, i);
+        count(mpack_type_int);
+        return ok();
+    }
+    bool Uint64(uint64_t u) {mpack_write_u64(writer, u); count(mpack_type_uint); return ok();}
+
+    bool Double(double d) {
+        if (options->use_float) {
+            mpack_write_float(writer, (float)d);
+            count(mpack_type_float);
+        } else {
+            mpack_write_double(writer, d);
+            count(mpack_type_double);
         }
+        return ok();
+    }
 
-        default:
+    // Numbers are parsed as strings and converted by json_parse_number(),
+    // which classifies them as rapidjson would.
+    bool RawNumber(const char* str, SizeType length, bool copy) {
+        json_number_t number;
+        json_parse_number(str, length, &number);
+        switch (number.type) {
+            case json_number_uint:   return Uint64(number.v.u);
+            case json_number_int:    return Int64(number.v.i);
+            case json_number_double: return Double(number.v.d);
+        }
+        return true;
+    }
+
+    bool String(const char* str, SizeType length, bool copy) {
+        return write_string(options, writer, scratch, stats, str, length, true);
+    }
+
+    bool Key(const char* str, SizeType length, bool copy) {
+        return write_string(options, writer, scratch, stats, str, length, false);
+    }
+
+    bool StartObject() {mpack_start_map(writer, counts->data[next++]); count(mpack_type_map); return ok();}
+    bool EndObject(SizeType count) {mpack_finish_map(writer); return ok();}
+    bool StartArray() {mpack_start_array(writer, counts->data[next++]); count(mpack_type_array); return ok();}
+    bool EndArray(SizeType count) {mpack_finish_array(writer); return ok();}
+};
+
+// Parses a single top-level value from the stream with the given handler.
+//
+// rapidjson still validates numbers, but it passes them to the handler as
+// strings rather than converting them itself; see number.h.
+template <class StreamType, class HandlerType>
+static bool parse_value(options_t* options, Reader& reader, StreamType& stream, HandlerType& handler) {
+    if (options->lax)
+        reader.Parse<kParseStopWhenDoneFlag | kParseNumbersAsStringsFlag | kParseCommentsFlag | kParseTrailingCommasFlag>(stream, handler);
+    else
+        reader.Parse<kParseStopWhenDoneFlag | kParseNumbersAsStringsFlag>(stream, handler);
+    return !reader.HasParseError();
+}
+
+// A rapidjson input stream that reads the input incrementally in chunks
+// rather than loading the whole file up front. Bytes from the start of the
+// current top-level value (the mark) are retained so that the value can be
+// parsed again for its second pass; everything before the mark is discarded
+// when the buffer is refilled. Memory usage is therefore bounded by the size
+// of the largest top-level value rather than by the size of the input.
+//
+// We use read() rather than fread() so that a refill returns whatever is
+// available on a pipe instead of blocking until the whole chunk is full.
+//
+// If the input is a regular file, it is instead mapped into memory in its
+// entirety and parsed in place; the stream then never needs to refill.
+//
+// If stats is not NULL, refills count the bytes read and the time spent
+// waiting for them.
+struct ChunkedStream {
+    typedef char Ch;
+
+    options_t* options;
+    stats_t* stats;
+    int fd;
+    char* buffer;
+    size_t capacity;
+    size_t mark;      // start of the current value
+    size_t pos;       // read position
+    size_t end;       // end of data in the buffer
+    size_t discarded; // input offset of the start of the buffer
+    bool eof;
+    bool error;
+    mapped_file_t mapped;
+    bool is_mapped;
+
+    Ch Peek() {
+        if (pos == end && !Fill())
+            return '\0';
+        return buffer[pos];
+    }
+
+    Ch Take() {
+        Ch c = Peek();
+        if (pos != end)
+            ++pos;
+        return c;
+    }
+
+    size_t Tell() const {
+        return discarded + pos;
+    }
+
+    // Marks the current position as the start of a top-level value.
+    void Mark() {
+        mark = pos;
+    }
+
+    // The time spent waiting for input so far, if it's counted.
+    double ReadSeconds() const {
+        return stats ? stats->read_seconds : 0;
+    }
+
+    bool Fill();
+
+    // not implemented; the stream is read-only
+    Ch* PutBegin() {RAPIDJSON_ASSERT(false); return 0;}
+    void Put(Ch) {RAPIDJSON_ASSERT(false);}
+    void Flush() {RAPIDJSON_ASSERT(false);}
+    size_t PutEnd(Ch*) {RAPIDJSON_ASSERT(false); return 0;}
+};
+
+bool ChunkedStream::Fill() {
+    if (eof || error)
+        return false;
+
+    // discard everything before the mark
+    if (mark > 0) {
+        memmove(buffer, buffer + mark, end - mark);
+        discarded += mark;
+        pos -= mark;
+        end -= mark;
+        mark = 0;
+    }
+
+    // grow the buffer if the current value fills it entirely
+    if (end == capacity) {
+        char* new_buffer = (char*)realloc(buffer, capacity * 2);
+        if (!new_buffer) {
+            fprintf(stderr, "%s: allocation failure\n", options->command);
+            error = true;
             return false;
+        }
+        buffer = new_buffer;
+        capacity *= 2;
     }
 
-    return mpack_writer_error(writer) == mpack_ok;
+    double start = stats ? stats_now() : 0;
+    ssize_t n;
+    do {
+        n = read(fd, buffer + end, capacity - end);
+    } while (n < 0 && errno == EINTR);
+    if (stats) {
+        stats->read_seconds += stats_now() - start;
+        if (n > 0)
+            stats->bytes_in += (size_t)n;
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: error reading data\n", options->command);
+        error = true;
+        return false;
+    }
+    if (n == 0) {
+        eof = true;
+        return false;
+    }
+
+    // rapidjson treats a null byte as the end of the input, so we need to
+    // scan the data to make sure it has none. They are not legal JSON anyway.
+    const char* null_byte = (const char*)memchr(buffer + end, '\0', (size_t)n);
+    if (null_byte != NULL) {
+        fprintf(stderr, "%s: JSON cannot contain null bytes (found at offset %llu)\n", options->command,
+                (unsigned long long)(discarded + (size_t)(null_byte - buffer)));
+        error = true;
+        return false;
+    }
+
+    end += (size_t)n;
+    return true;
+}
+
+// Sets up a stream over data that is already entirely in memory. offset is
+// the offset of the data in the input, for error reporting.
+static void open_memory_stream(options_t* options, ChunkedStream* stream, const char* data, size_t size, size_t offset) {
+    memset(stream, 0, sizeof(*stream));
+    stream->options = options;
+    stream->fd = -1;
+    stream->buffer = (char*)data;
+    stream->capacity = stream->end = size;
+    stream->discarded = offset;
+    stream->eof = true;
 }
 
-static bool load_file(options_t* options, char** out_data, size_t* out_size) {
-    FILE* in_file;
+static bool open_stream(options_t* options, ChunkedStream* stream) {
+    memset(stream, 0, sizeof(*stream));
+    stream->options = options;
+
+    mapped_file_t mapped;
+    if (options->in_filename && map_file(options->in_filename, &mapped)) {
+        open_memory_stream(options, stream, mapped.data, mapped.size, 0);
+        stream->mapped = mapped;
+        stream->is_mapped = true;
+
+        // See Fill() regarding null bytes.
+        const char* null_byte = (const char*)memchr(stream->buffer, '\0', stream->end);
+        if (null_byte != NULL) {
+            fprintf(stderr, "%s: JSON cannot contain null bytes (found at offset %llu)\n", options->command,
+                    (unsigned long long)(null_byte - stream->buffer));
+            unmap_file(&stream->mapped);
+            return false;
+        }
+        return true;
+    }
+
     if (options->in_filename) {
-        in_file = fopen(options->in_filename, "rb");
-        if (in_file == NULL) {
+        stream->fd = open(options->in_filename, O_RDONLY);
+        if (stream->fd == -1) {
             fprintf(stderr, "%s: could not open \"%s\" for reading.\n", options->command, options->in_filename);
             return false;
         }
     } else {
-        in_file = stdin;
+        stream->fd = STDIN_FILENO;
     }
 
-    size_t capacity = 4096;
-    size_t size = 0;
-    char* data = (char*)malloc(capacity);
+    stream->capacity = BUFFER_SIZE;
+    stream->buffer = (char*)malloc(stream->capacity);
+    if (!stream->buffer) {
+        fprintf(stderr, "%s: allocation failure\n", options->command);
+        if (stream->fd != STDIN_FILENO)
+            close(stream->fd);
+        return false;
+    }
 
-    while (1) {
-        size_t n = fread(data + size, 1, capacity - size, in_file);
+    return true;
+}
 
-        // RapidJSON in-situ requires a null-terminated string, so we need to scan the
-        // data to make sure it has no null bytes. They are not legal JSON anyway.
-        for (size_t i = size; i < size + n; ++i) {
-            if (data[i] == '\0') {
-                fprintf(stderr, "%s: JSON cannot contain null bytes\n", options->command);
-                if (in_file != stdin)
-                    fclose(in_file);
-                free(data);
-                return false;
-            }
-        }
+static void close_stream(ChunkedStream* stream) {
+    if (stream->is_mapped) {
+        unmap_file(&stream->mapped);
+        return;
+    }
+    if (stream->fd != STDIN_FILENO)
+        close(stream->fd);
+    free(stream->buffer);
+}
 
-        size += n;
+// Converts all top-level values in the stream. The scratch buffer is used for
+// decoding base64 and is reused from one value to the next. If stats is not
+// NULL, the values are counted.
+static bool convert_values(options_t* options, ChunkedStream& stream, mpack_writer_t* writer, buffer_t* scratch,
+        stats_t* stats)
+{
+    Reader reader;
+    counts_t counts = {NULL, 0, 0};
+    counts_t stack = {NULL, 0, 0};
+    bool ok = true;
 
-        if (ferror(in_file)) {
-            fprintf(stderr, "%s: error reading data\n", options->command);
-            if (in_file != stdin)
-                fclose(in_file);
-            free(data);
-            return false;
-        }
+    while (stream.Peek() != '\0') {
+        // skip space characters
+        while (isspace(stream.Peek()))
+            stream.Take();
+        if (stream.Peek() == '\0')
+            break;
 
-        // We always need enough space to store the null-terminator
-        if (size == capacity) {
-            capacity *= 2;
-            data = (char*)realloc(data, capacity);
+        // first pass: count container elements. The record's latency starts
+        // once its first byte is available, and doesn't include any wait for
+        // the rest of it.
+        double start = options->histogram ? stats_now() : 0;
+        double read_seconds = stream.ReadSeconds();
+        stream.Mark();
+        counts.size = 0;
+        stack.size = 0;
+        CountHandler counter(options, &counts, &stack);
+        if (!parse_value(options, reader, stream, counter)) {
+            if (!stream.error && reader.GetParseErrorCode() != kParseErrorTermination)
+                fprintf(error_output(options), "%s: error parsing JSON at offset %i:\n    %s\n", options->command,
+                        (int)reader.GetErrorOffset(), GetParseError_En(reader.GetParseErrorCode()));
+            ok = false;
+            break;
         }
 
-        if (feof(in_file))
+        // second pass: write the value
+        MemoryStream value(stream.buffer + stream.mark, stream.pos - stream.mark);
+        WriteHandler handler(options, writer, scratch, stats, &counts);
+        if (!parse_value(options, reader, value, handler)) {
+            // Unless the writer failed, the handler has already reported the
+            // error. We flag it on the writer as mpack_error_data so that it
+            // doesn't complain about unclosed containers, and so that the
+            // caller can tell it from a write error.
+            if (mpack_writer_error(writer) == mpack_ok)
+                mpack_writer_flag_error(writer, mpack_error_data);
+            ok = false;
             break;
-
-        // This shouldn't happen; no bytes should mean error or EOF. We
-        // check and throw an error anyway to avoid an infinite loop.
-        if (n == 0) {
-            fprintf(stderr, "%s: error reading data\n", options->command);
-            if (in_file != stdin)
-                fclose(in_file);
-            free(data);
-            return false;
         }
+        if (stats)
+            ++stats->records;
+        if (options->histogram)
+            stats_record(stats, start, stream.ReadSeconds() - read_seconds, stream.pos - stream.mark);
     }
 
-    data[size] = '\0';
+    if (stream.error)
+        ok = false;
 
-    fclose(in_file);
-    *out_data = data;
-    *out_size = size;
-    return true;
+    free(counts.data);
+    free(stack.data);
+    return ok;
 }
 
-static bool convert(options_t* options) {
-    char* data = NULL;
-    size_t size = 0;
-    if (!load_file(options, &data, &size))
-        return false;
+// With -V, each value is parsed once with a handler that does nothing, to
+// check the input without converting it. The encoding is validated as well
+// since MessagePack strings must be UTF-8. Base64 strings are not decoded.
+struct ValidateHandler : public BaseReaderHandler<UTF8<>, ValidateHandler> {};
 
-    // The data has been null-terminated by load_file()
-    StringStream stream(data);
-
-    mpack_writer_t writer;
-    if (options->out_filename != NULL)
-        mpack_writer_init_file(&writer, options->out_filename);
-    else
-        mpack_writer_init_stdfile(&writer, stdout, true);
+static bool validate_values(options_t* options, ChunkedStream& stream, stats_t* stats) {
+    Reader reader;
+    ValidateHandler handler;
 
     while (stream.Peek() != '\0') {
         // skip space characters
@@ -297,35 +596,460 @@ static bool convert(options_t* options) {
         if (stream.Peek() == '\0')
             break;
 
-        Document document;
+        // Marking the start of each value lets the stream discard the values
+        // before it.
+        double start = options->histogram ? stats_now() : 0;
+        double read_seconds = stream.ReadSeconds();
+        stream.Mark();
         if (options->lax)
-            document.ParseStream<kParseStopWhenDoneFlag | kParseFullPrecisionFlag | kParseCommentsFlag | kParseTrailingCommasFlag>(stream);
+            reader.Parse<kParseStopWhenDoneFlag | kParseNumbersAsStringsFlag | kParseValidateEncodingFlag |
+                    kParseCommentsFlag | kParseTrailingCommasFlag>(stream, handler);
         else
-            document.ParseStream<kParseStopWhenDoneFlag | kParseFullPrecisionFlag>(stream);
-
-        if (document.HasParseError()) {
-            fprintf(stderr, "%s: error parsing JSON at offset %i:\n    %s\n", options->command,
-                    (int)document.GetErrorOffset(), GetParseError_En(document.GetParseError()));
-            mpack_writer_destroy(&writer);
-            free(data);
+            reader.Parse<kParseStopWhenDoneFlag | kParseNumbersAsStringsFlag | kParseValidateEncodingFlag>(stream, handler);
+        if (reader.HasParseError()) {
+            if (!stream.error)
+                fprintf(stderr, "%s: error parsing JSON at offset %llu:\n    %s\n", options->command,
+                        (unsigned long long)reader.GetErrorOffset(), GetParseError_En(reader.GetParseErrorCode()));
             return false;
         }
+        if (stats)
+            ++stats->records;
+        if (options->histogram)
+            stats_record(stats, start, stream.ReadSeconds() - read_seconds, stream.pos - stream.mark);
+    }
+
+    return !stream.error;
+}
+
+static FILE* open_output(options_t* options) {
+    if (!options->out_filename)
+        return stdout;
+    FILE* out_file = fopen(options->out_filename, "wb");
+    if (out_file == NULL)
+        fprintf(stderr, "%s: could not open \"%s\" for writing.\n", options->command, options->out_filename);
+    return out_file;
+}
 
-        write_value(options, document, &writer);
+// Closes the output file, or flushes stdout. Returns false on error.
+static bool close_output(FILE* out_file) {
+    if (out_file == stdout)
+        return fflush(out_file) == 0;
+    return fclose(out_file) == 0;
+}
+
+// Output for the serial conversion. If stats is not NULL, the writer's flush
+// function counts the bytes written and the time spent writing them.
+typedef struct output_t {
+    FILE* file;
+    stats_t* stats;
+} output_t;
+
+static void output_flush(mpack_writer_t* writer, const char* data, size_t count) {
+    output_t* output = (output_t*)writer->context;
+    double start = output->stats ? stats_now() : 0;
+    if (fwrite(data, 1, count, output->file) != count)
+        mpack_writer_flag_error(writer, mpack_error_io);
+    if (output->stats) {
+        output->stats->write_seconds += stats_now() - start;
+        output->stats->bytes_out += count;
     }
+}
+
+static bool convert_serial(options_t* options, ChunkedStream& stream, stats_t* stats) {
+    workspace_t* workspace = options->workspace;
+    output_t output = {open_output(options), stats};
+    if (output.file == NULL)
+        return false;
+
+    char* buffer = workspace ? workspace->buffer : (char*)malloc(BUFFER_SIZE);
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, BUFFER_SIZE);
+    mpack_writer_set_context(&writer, &output);
+    mpack_writer_set_flush(&writer, output_flush);
+
+    buffer_t local_scratch = {NULL, 0, 0};
+    buffer_t* scratch = workspace ? &workspace->scratch : &local_scratch;
+    bool ok = convert_values(options, stream, &writer, scratch, stats);
+    buffer_destroy(&local_scratch);
 
     mpack_error_t error = mpack_writer_destroy(&writer);
-    if (error != mpack_ok) {
+    if (!close_output(output.file) && error == mpack_ok)
+        error = mpack_error_io;
+    if (!workspace)
+        free(buffer);
+
+    // A write error stops the conversion without being reported by it.
+    if (error != mpack_ok && error != mpack_error_data) {
         fprintf(stderr, "%s: error writing MessagePack: %s (%i)\n", options->command,
                 mpack_error_to_string(error), (int)error);
-        free(data);
         return false;
     }
 
-    free(data);
+    return ok;
+}
+
+// In parallel mode, the main thread splits the input into jobs at the
+// boundaries between top-level values, and workers parse and convert each
+// job into their own buffer. Finding the boundaries doesn't require parsing:
+// we only need to track nesting depth, strings and comments. Any whitespace
+// outside of a value, or the closing bracket of a top-level object or array,
+// is a boundary. The values themselves are validated by the workers.
+//
+// If the input is invalid, the scanner may end up splitting it in the wrong
+// place. This doesn't matter since the job containing the first error will
+// fail anyway, and nothing after it is output.
+
+typedef enum scan_state_t {
+    scan_value,
+    scan_string,
+    scan_escape,
+    scan_slash,
+    scan_line_comment,
+    scan_block_comment,
+    scan_block_star,
+} scan_state_t;
+
+typedef struct scanner_t {
+    scan_state_t state;
+    size_t depth;
+} scanner_t;
+
+// Scans from p up to end, returning the position just past the first
+// boundary found, or NULL if there is none. The scanner keeps its state so
+// that scanning can continue with the following data.
+static const char* scan_boundary(scanner_t* scanner, const char* p, const char* end) {
+    while (p != end) {
+        char c = *p;
+        switch (scanner->state) {
+            case scan_value:
+                if (c == '"') {
+                    scanner->state = scan_string;
+                } else if (c == '{' || c == '[') {
+                    ++scanner->depth;
+                } else if (c == '}' || c == ']') {
+                    if (scanner->depth > 0 && --scanner->depth == 0)
+                        return p + 1;
+                } else if (c == '/') {
+                    scanner->state = scan_slash;
+                } else if (scanner->depth == 0 && isspace((unsigned char)c)) {
+                    return p + 1;
+                }
+                break;
+
+            case scan_string:
+                // skip quickly over the contents of strings
+                while (c != '"' && c != '\\') {
+                    if (++p == end)
+                        return NULL;
+                    c = *p;
+                }
+                scanner->state = (c == '"') ? scan_value : scan_escape;
+                break;
+
+            case scan_escape:
+                scanner->state = scan_string;
+                break;
+
+            case scan_slash:
+                if (c == '/') {
+                    scanner->state = scan_line_comment;
+                } else if (c == '*') {
+                    scanner->state = scan_block_comment;
+                } else {
+                    // not a comment; rescan this character as part of a value
+                    scanner->state = scan_value;
+                    continue;
+                }
+                break;
+
+            case scan_line_comment:
+                if (c == '\n')
+                    scanner->state = scan_value;
+                break;
+
+            case scan_block_comment:
+                if (c == '*')
+                    scanner->state = scan_block_star;
+                break;
+
+            case scan_block_star:
+                if (c == '/')
+                    scanner->state = scan_value;
+                else if (c != '*')
+                    scanner->state = scan_block_comment;
+                break;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+static bool convert_job(void* context, parallel_job_t* job) {
+    options_t job_options = *(options_t*)context;
+    job_options.error_file = job->error_file;
+    options_t* options = &job_options;
+
+    ChunkedStream stream;
+    open_memory_stream(options, &stream, job->data, job->size, job->offset);
+
+    char* data;
+    size_t size;
+    mpack_writer_t writer;
+    mpack_writer_init_growable(&writer, &data, &size);
+
+    stats_t* stats = (options->stats || options->histogram) ? &job->stats : NULL;
+    bool ok = convert_values(options, stream, &writer, &job->scratch, stats);
+
+    mpack_error_t error = mpack_writer_destroy(&writer);
+    if (error != mpack_ok && error != mpack_error_data) {
+        fprintf(error_output(options), "%s: error writing MessagePack: %s (%i)\n", options->command,
+                mpack_error_to_string(error), (int)error);
+        return false;
+    }
+    if (!ok)
+        return false;
+
+    // the job takes the writer's buffer as its output
+    buffer_destroy(&job->output);
+    job->output.data = data;
+    job->output.size = job->output.capacity = size;
     return true;
 }
 
+// Hands off the input from the stream's mark to its read position as a job,
+// and moves the mark forward. Returns false if a job has failed or on
+// allocation failure.
+static bool submit_job(parallel_t* parallel, options_t* options, ChunkedStream* stream) {
+    parallel_job_t* job = parallel_next_job(parallel);
+    if (!job)
+        return false;
+
+    job->size = stream->pos - stream->mark;
+    job->offset = stream->Tell() - job->size;
+
+    if (stream->is_mapped) {
+        job->data = stream->buffer + stream->mark;
+    } else {
+        // the stream's buffer will be reused, so the job needs its own copy
+        job->owned = (char*)malloc(job->size);
+        if (!job->owned) {
+            fprintf(stderr, "%s: allocation failure\n", options->command);
+            return false;
+        }
+        memcpy(job->owned, stream->buffer + stream->mark, job->size);
+        job->data = job->owned;
+    }
+
+    parallel_submit(parallel);
+    stream->Mark();
+    return true;
+}
+
+static bool is_blank(const char* p, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        if (!isspace((unsigned char)p[i]))
+            return false;
+    return true;
+}
+
+// In unbuffered mode, we always convert this way, even on a single thread.
+// The writer thread flushes the output whenever it runs out of values to
+// write, so each value is output as soon as the worker has converted it.
+static bool convert_parallel(options_t* options, ChunkedStream& stream, stats_t* stats) {
+    FILE* out_file = open_output(options);
+    if (out_file == NULL)
+        return false;
+
+    // Unbuffered mode converts on a single worker if -j isn't given.
+    size_t threads = options->threads > 1 ? options->threads : 1;
+
+    parallel_t parallel;
+    if (!parallel_start(&parallel, threads, convert_job, options, out_file, stats, options->unbuffered)) {
+        fprintf(stderr, "%s: could not start threads\n", options->command);
+        if (out_file != stdout)
+            fclose(out_file);
+        return false;
+    }
+
+    // Split the input into jobs of whole values
+    scanner_t scanner = {scan_value, 0};
+    bool submit_error = false;
+    stream.Mark();
+    while (stream.pos != stream.end || stream.Fill()) {
+        const char* boundary = scan_boundary(&scanner, stream.buffer + stream.pos, stream.buffer + stream.end);
+        if (!boundary) {
+            stream.pos = stream.end;
+            continue;
+        }
+        stream.pos = (size_t)(boundary - stream.buffer);
+
+        // In unbuffered mode each value is a job of its own so that it is
+        // output as soon as possible. Whitespace between values is skipped.
+        if (options->unbuffered && is_blank(stream.buffer + stream.mark, stream.pos - stream.mark)) {
+            stream.Mark();
+            continue;
+        }
+        if ((stream.pos - stream.mark >= PARALLEL_JOB_SIZE || options->unbuffered) &&
+                !submit_job(&parallel, options, &stream))
+        {
+            submit_error = true;
+            break;
+        }
+    }
+    if (!submit_error && !stream.error && stream.pos != stream.mark)
+        submit_error = !submit_job(&parallel, options, &stream);
+
+    bool ok = parallel_finish(&parallel) && !submit_error && !stream.error;
+    if (parallel.write_error)
+        fprintf(stderr, "%s: error writing MessagePack\n", options->command);
+
+    if (!close_output(out_file) && ok) {
+        fprintf(stderr, "%s: error writing MessagePack\n", options->command);
+        ok = false;
+    }
+    return ok;
+}
+
+// Converts the input file to the output file. If stats is not NULL, the
+// counters are added to it.
+static bool convert_file(options_t* options, stats_t* stats) {
+    double start = stats ? stats_now() : 0;
+    double io_seconds = stats ? stats->read_seconds + stats->write_seconds : 0;
+    ChunkedStream stream;
+    if (!open_stream(options, &stream))
+        return false;
+
+    // The stream counts its reads separately since in parallel mode the
+    // writer thread updates the totals until the conversion is finished.
+    stats_t read_stats;
+    memset(&read_stats, 0, sizeof(read_stats));
+    if (stats)
+        stream.stats = &read_stats;
+    if (stream.is_mapped)
+        read_stats.bytes_in = stream.end;
+
+    bool serial = (options->threads <= 1 && !options->unbuffered) || options->validate;
+    bool ok;
+    if (options->validate)
+        ok = validate_values(options, stream, stats);
+    else if (serial)
+        ok = convert_serial(options, stream, stats);
+    else
+        ok = convert_parallel(options, stream, stats);
+
+    close_stream(&stream);
+
+    if (stats) {
+        stats_add(stats, &read_stats);
+
+        // Serial conversion is whatever time isn't spent reading or writing.
+        if (serial)
+            stats->convert_seconds += stats_now() - start - (stats->read_seconds + stats->write_seconds - io_seconds);
+    }
+    return ok;
+}
+
+static void report(options_t* options, const stats_t* stats, double start) {
+    stats_stop_reporter();
+    if (options->stats)
+        stats_report(options->command, options->stats, stats, stats_now() - start);
+    if (options->histogram)
+        stats_report_histograms(options->command, options->stats == stats_json ? stats_json : stats_text, stats);
+}
+
+static bool convert(options_t* options) {
+    double start = stats_now();
+    stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats_t* counters = (options->stats || options->histogram) ? &stats : NULL;
+    if (options->histogram)
+        stats_start_reporter(options->command, options->stats == stats_json ? stats_json : stats_text, &stats);
+    bool ok = convert_file(options, counters);
+    report(options, &stats, start);
+    return ok;
+}
+
+// Each worker counts a file in its workspace's stats and adds them to the
+// totals when the file is done, so SIGUSR1 prints the histograms of the files
+// finished so far.
+typedef struct batch_context_t {
+    options_t* options;
+    workspace_t* workspaces;
+    bool counting;
+    pthread_mutex_t mutex;
+    stats_t totals;
+} batch_context_t;
+
+static bool convert_batch_file(void* context, size_t worker, const char* in_filename, const char* out_filename) {
+    batch_context_t* batch = (batch_context_t*)context;
+    workspace_t* workspace = &batch->workspaces[worker];
+
+    options_t options = *batch->options;
+    options.in_filename = in_filename;
+    options.out_filename = out_filename;
+    options.threads = 1;
+    options.unbuffered = false;
+    options.workspace = workspace;
+
+    stats_t* stats = NULL;
+    if (batch->counting) {
+        stats = &workspace->stats;
+        memset(stats, 0, sizeof(*stats));
+    }
+    bool ok = convert_file(&options, stats);
+    if (stats) {
+        pthread_mutex_lock(&batch->mutex);
+        stats_add(&batch->totals, stats);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: failed to %s \"%s\"\n", options.command, options.validate ? "validate" : "convert",
+                in_filename);
+        return false;
+    }
+    return true;
+}
+
+// Converts every file in the batch, one file per worker thread at a time.
+// Statistics and histograms are the totals over all files, printed at exit.
+static bool convert_batch(options_t* options, batch_t* batch) {
+    double start = stats_now();
+    size_t threads = options->threads ? options->threads : 1;
+    batch_context_t context;
+    memset(&context, 0, sizeof(context));
+    context.options = options;
+    context.counting = options->stats || options->histogram;
+    pthread_mutex_init(&context.mutex, NULL);
+    if (options->histogram)
+        stats_start_reporter(options->command, options->stats == stats_json ? stats_json : stats_text,
+                &context.totals);
+    context.workspaces = (workspace_t*)calloc(threads, sizeof(workspace_t));
+    bool ok = context.workspaces != NULL;
+    for (size_t i = 0; ok && i < threads; ++i) {
+        context.workspaces[i].buffer = (char*)malloc(BUFFER_SIZE);
+        ok = context.workspaces[i].buffer != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: allocation failure\n", options->command);
+    } else {
+        ok = batch_run(batch, threads, convert_batch_file, &context);
+    }
+
+    if (context.workspaces) {
+        for (size_t i = 0; i < threads; ++i) {
+            workspace_t* workspace = &context.workspaces[i];
+            free(workspace->buffer);
+            buffer_destroy(&workspace->scratch);
+        }
+        free(context.workspaces);
+    }
+
+    pthread_mutex_destroy(&context.mutex);
+    report(options, &context.totals, start);
+    return ok;
+}
+
 static void parse_min_bytes(options_t* options) {
     const char* arg = optarg;
     char* end;
@@ -342,8 +1066,21 @@ static void parse_min_bytes(options_t* options) {
     options->base64_min_bytes = (size_t)value;
 }
 
+static void parse_threads(options_t* options) {
+    const char* arg = optarg;
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value <= 0 || value > PARALLEL_MAX_THREADS) {
+        fprintf(stderr, "%s: -j requires a thread count between 1 and %i, not \"%s\"\n", options->command, PARALLEL_MAX_THREADS, arg);
+        exit(EXIT_FAILURE);
+    }
+    options->threads = (size_t)value;
+}
+
 static void usage(const char* command) {
-    fprintf(stderr, "Usage: %s [-i <infile>] [-o <outfile>] [-lfb] [-B <min>]\n", command);
+    fprintf(stderr, "Usage: %s [-i <infile>] [-o <outfile>] [-lfbuVsSH] [-B <min>] [-j <threads>]\n", command);
+    fprintf(stderr, "       %s [options] [-L] [-O <template>] [<infile>...]\n", command);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -i <infile>  Input filename (default stdin)\n");
     fprintf(stderr, "    -o <outfile>  Output filename (default stdout)\n");
@@ -351,6 +1088,16 @@ static void usage(const char* command) {
     fprintf(stderr, "    -f  Write floats instead of doubles\n");
     fprintf(stderr, "    -b  Convert base64 strings with \"base64:\" prefix to bin\n");
     fprintf(stderr, "    -B <min>  Try to convert any base64 string of at least <min> bytes to bin\n");
+    fprintf(stderr, "    -j <threads>  Convert top-level values on multiple threads\n");
+    fprintf(stderr, "    -u  Unbuffered, output each top-level value as soon as it is converted\n");
+    fprintf(stderr, "    -V  Validate the input without converting it, reporting the offset of the first error\n");
+    fprintf(stderr, "    -s  Print conversion statistics to stderr\n");
+    fprintf(stderr, "    -S  Print conversion statistics to stderr as a line of JSON\n");
+    fprintf(stderr, "    -H  Print histograms of record latency and size to stderr at exit and on SIGUSR1\n");
+    fprintf(stderr, "    -L  Batch mode, read input filenames from stdin, one per line\n");
+    fprintf(stderr, "    -O <template>  Batch mode output filenames, where %%s is the input without\n");
+    fprintf(stderr, "                   its extension and %%n is the same without its directory\n");
+    fprintf(stderr, "                   (default \"%%s.mp\")\n");
     fprintf(stderr, "    -h  Print this help\n");
     fprintf(stderr, "    -v  Print version information\n");
 }
@@ -359,9 +1106,11 @@ static void version(const char* command) {
     fprintf(stderr, "%s version %s -- %s\n", command, VERSION, "https://github.com/ludocode/msgpack-tools");
     fprintf(stderr, "RapidJSON version %s -- %s\n", RAPIDJSON_VERSION_STRING, "http://rapidjson.org/");
     fprintf(stderr, "MPack version %s -- %s\n", MPACK_VERSION_STRING, "https://github.com/ludocode/mpack");
-    fprintf(stderr, "libb64 version %s -- %s\n", LIBB64_VERSION, "http://libb64.sourceforge.net/");
 }
 
+// The library (src/msgpacktools.cpp) includes this file to call its
+// conversion routines directly.
+#ifndef JSON2MSGPACK_NO_MAIN
 int main(int argc, char** argv) {
     options_t options;
     memset(&options, 0, sizeof(options));
@@ -369,7 +1118,7 @@ int main(int argc, char** argv) {
 
     opterr = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "i:o:lfbB:hv?")) != -1) {
+    while ((opt = getopt(argc, argv, "i:o:lfbB:j:O:uVsSHLhv?")) != -1) {
         switch (opt) {
             case 'i':
                 options.in_filename = optarg;
@@ -389,6 +1138,30 @@ int main(int argc, char** argv) {
             case 'B':
                 parse_min_bytes(&options);
                 break;
+            case 'j':
+                parse_threads(&options);
+                break;
+            case 'u':
+                options.unbuffered = true;
+                break;
+            case 'V':
+                options.validate = true;
+                break;
+            case 's':
+                options.stats = stats_text;
+                break;
+            case 'S':
+                options.stats = stats_json;
+                break;
+            case 'H':
+                options.histogram = true;
+                break;
+            case 'L':
+                options.file_list = true;
+                break;
+            case 'O':
+                options.output_template = optarg;
+                break;
             case 'h':
                 usage(options.command);
                 return EXIT_SUCCESS;
@@ -401,7 +1174,7 @@ int main(int argc, char** argv) {
                     usage(options.command);
                     return EXIT_SUCCESS;
                 }
-                if (optopt == 'i' || optopt == 'o' || optopt == 'B')
+                if (optopt == 'i' || optopt == 'o' || optopt == 'B' || optopt == 'j' || optopt == 'O')
                     fprintf(stderr, "%s: -%c requires an argument\n", options.command, optopt);
                 else
                     fprintf(stderr, "%s: invalid option -- '%c'\n", options.command, optopt);
@@ -410,11 +1183,51 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (optind < argc) {
-        fprintf(stderr, "%s: not an option -- \"%s\"\n", options.command, argv[optind]);
+    if (options.validate && options.out_filename) {
+        fprintf(stderr, "%s: -V does not write output, so -o cannot be used with it\n", options.command);
         usage(options.command);
         return EXIT_FAILURE;
     }
 
-    return convert(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    // Input files as arguments or -L switch to batch mode
+    if (optind == argc && !options.file_list) {
+        if (options.output_template) {
+            fprintf(stderr, "%s: -O requires input files or -L\n", options.command);
+            usage(options.command);
+            return EXIT_FAILURE;
+        }
+        return convert(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.in_filename || options.out_filename) {
+        fprintf(stderr, "%s: -i and -o cannot be used with input files or -L\n", options.command);
+        usage(options.command);
+        return EXIT_FAILURE;
+    }
+    if (!options.output_template)
+        options.output_template = "%s.mp";
+    if (!batch_check_template(options.output_template)) {
+        fprintf(stderr, "%s: -O requires a template containing %%s or %%n, not \"%s\"\n",
+                options.command, options.output_template);
+        return EXIT_FAILURE;
+    }
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    bool ok = true;
+    for (int i = optind; ok && i < argc; ++i)
+        ok = batch_add(&batch, argv[i], strlen(argv[i]));
+    if (!ok)
+        fprintf(stderr, "%s: allocation failure\n", options.command);
+    if (ok && options.file_list && !batch_read_list(&batch, stdin)) {
+        fprintf(stderr, "%s: error reading file list\n", options.command);
+        ok = false;
+    }
+    if (ok)
+        ok = batch_make_outputs(&batch, options.command, options.output_template, !options.validate);
+    if (ok)
+        ok = convert_batch(&options, &batch);
+    batch_destroy(&batch);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+#endif
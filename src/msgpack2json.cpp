@@ -29,6 +29,17 @@
 #define RAPIDJSON_ASSERT(x) ((void)(x))
 
 #include "common.h"
+#include "base64.h"
+#include "batch.h"
+#include "escape.h"
+#include "index.h"
+#include "number.h"
+#include "parallel.h"
+#include "select.h"
+#include "stats.h"
+#include "utf8.h"
+
+#include <errno.h>
 
 #define HEX_PREFIX_BYTE_COUNT 8
 #define BIN_EXT_DESCRIPTION_LENGTH 64
@@ -51,15 +62,87 @@ typedef struct options_t {
     bool pretty;
     bool base64;
     bool base64_prefix;
+    size_t threads;
+    stats_mode_t stats;
+    bool histogram;
+    bool unbuffered;
+    size_t async_block_size; // 0 unless -a is given
+    const char* output_template; // batch mode, with input files or -L
+    bool file_list;
+    struct workspace_t* workspace;
+    select_t* select; // paths given with -e, or NULL
+    const char* index_filename; // -I
+    bool has_range;             // -r
+    record_range_t range;
+    bool validate;              // -V
+    FILE* error_file;           // conversion errors go here if not NULL
 } options_t;
 
+// Returns the stream conversion errors are reported to. Parallel jobs capture
+// theirs so that only the first failed job's errors are printed.
+static FILE* error_output(options_t* options) {
+    return options->error_file ? options->error_file : stderr;
+}
+
+// Buffers kept by each batch mode worker and reused for every file it
+// converts, so that converting many small files doesn't allocate and free
+// them for each one.
+typedef struct workspace_t {
+    char* reader_buffer;
+    char* output_buffer;
+    buffer_t scratch;
+    stats_t stats; // counters of the file being converted
+} workspace_t;
+
+// A rapidjson writer (Writer or PrettyWriter) that writes strings with our
+// own escaping, which scans for characters to escape a block at a time and
+// copies the runs between them to the output stream in bulk. Strings can
+// also be written in pieces, escaping each piece directly into the stream.
+template <class BaseWriter, class StreamType>
+class JsonWriter : public BaseWriter {
+public:
+    typedef typename BaseWriter::Ch Ch;
+
+    explicit JsonWriter(StreamType& stream) : BaseWriter(stream) {}
+
+    bool String(const Ch* str, SizeType length, bool copy = false) {
+        if (!StartString())
+            return false;
+        StringPart(str, length);
+        return EndString();
+    }
+
+    bool Key(const Ch* str, SizeType length, bool copy = false) {
+        return String(str, length, copy);
+    }
+
+    // Writes the opening quote of a string, along with whatever separator or
+    // indentation precedes it. This works for keys as well as values.
+    bool StartString() {
+        return BaseWriter::RawValue("\"", 1, kStringType);
+    }
+
+    void StringPart(const char* data, size_t len) {
+        json_escape(*this->os_, data, len);
+    }
+
+    bool EndString() {
+        this->os_->Put('"');
+
+        // flush a top-level string, as the writers do for complete values
+        if (this->IsComplete())
+            this->os_->Flush();
+        return true;
+    }
+};
+
 // Reads MessagePack string bytes and outputs a JSON string
 template <class WriterType>
 static bool string(mpack_reader_t* reader, WriterType& writer, options_t* options, uint32_t len) {
     if (mpack_should_read_bytes_inplace(reader, len)) {
         const char* str = mpack_read_bytes_inplace(reader, len);
         if (mpack_reader_error(reader) != mpack_ok) {
-            fprintf(stderr, "%s: error reading string bytes\n", options->command);
+            fprintf(error_output(options), "%s: error reading string bytes\n", options->command);
             return false;
         }
         bool ok = writer.String(str, len);
@@ -67,84 +150,87 @@ static bool string(mpack_reader_t* reader, WriterType& writer, options_t* option
         return ok;
     }
 
-    char* str = (char*)malloc(len);
-    mpack_read_bytes(reader, str, len);
-    if (mpack_reader_error(reader) != mpack_ok) {
-        fprintf(stderr, "%s: error reading string bytes\n", options->command);
-        free(str);
+    // The string is too big to read in place, so we read it in chunks and
+    // escape each one straight into the output. Memory usage is therefore
+    // bounded no matter how large the string is.
+    if (!writer.StartString())
         return false;
+    while (len > 0) {
+        char buf[4096];
+        uint32_t count = (len < sizeof(buf)) ? len : sizeof(buf);
+        len -= count;
+        mpack_read_bytes(reader, buf, count);
+        if (mpack_reader_error(reader) != mpack_ok) {
+            fprintf(error_output(options), "%s: error reading string bytes\n", options->command);
+            return false;
+        }
+        writer.StringPart(buf, count);
     }
     mpack_done_str(reader);
-
-    bool ok = writer.String(str, len);
-    free(str);
-    return ok;
+    return writer.EndString();
 }
 
 static const char* ext_str = "ext:";
 static const char* b64_str = "base64:";
 
-static uint32_t base64_len(uint32_t len) {
-    return ((len + 3) * 4) / 3; // TODO check this
-}
-
-// Converts MessagePack bin/ext bytes to JSON base64 string
+// Reads MessagePack bin/ext bytes and outputs a JSON base64 string with the
+// given prefix. Base64 never needs escaping, so we build the string with its
+// quotes and write it raw.
 template <class WriterType>
-static bool base64(mpack_reader_t* reader, WriterType& writer, options_t* options, uint32_t len, char* output, char* p, bool prefix) {
-    if (prefix) {
-        memcpy(p, b64_str, strlen(b64_str));
-        p += strlen(b64_str);
+static bool base64(mpack_reader_t* reader, WriterType& writer, options_t* options, buffer_t* scratch, uint32_t len, const char* prefix, size_t prefix_len) {
+    char* output = buffer_scratch(scratch, 2 + prefix_len + base64_encoded_size(len));
+    if (!output) {
+        fprintf(error_output(options), "%s: allocation failure\n", options->command);
+        mpack_reader_flag_error(reader, mpack_error_memory);
+        return false;
     }
 
-    base64_encodestate state;
-    base64_init_encodestate(&state);
+    char* p = output;
+    *p++ = '"';
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
 
-    while (len > 0) {
-        char buf[4096];
-        uint32_t count = (len < sizeof(buf)) ? len : sizeof(buf);
-        len -= count;
-        mpack_read_bytes(reader, buf, count);
+    if (len > 0 && mpack_should_read_bytes_inplace(reader, len)) {
+        const char* data = mpack_read_bytes_inplace(reader, len);
         if (mpack_reader_error(reader) != mpack_ok) {
-            fprintf(stderr, "%s: error reading base64 bytes\n", options->command);
+            fprintf(error_output(options), "%s: error reading base64 bytes\n", options->command);
             return false;
         }
-        p += base64_encode_block(buf, (int)count, p, &state);
+        p += base64_encode(data, len, p);
+
+    } else {
+        while (len > 0) {
+            char buf[4095]; // a multiple of 3 so that only the last chunk is padded
+            uint32_t count = (len < sizeof(buf)) ? len : sizeof(buf);
+            len -= count;
+            mpack_read_bytes(reader, buf, count);
+            if (mpack_reader_error(reader) != mpack_ok) {
+                fprintf(error_output(options), "%s: error reading base64 bytes\n", options->command);
+                return false;
+            }
+            p += base64_encode(buf, count, p);
+        }
     }
-    p += base64_encode_blockend(p, &state);
 
-    return writer.String(output, p - output);
+    *p++ = '"';
+    return writer.RawValue(output, (size_t)(p - output), kStringType);
 }
 
 // Reads MessagePack bin bytes and outputs a JSON base64 string
 template <class WriterType>
-static bool base64_bin(mpack_reader_t* reader, WriterType& writer, options_t* options, uint32_t len, bool prefix) {
-    uint32_t new_len = base64_len(len) + (prefix ? strlen(b64_str) : 0);
-    char* output = (char*)malloc(new_len);
-
-    bool ret = base64(reader, writer, options, len, output, output, prefix);
-
+static bool base64_bin(mpack_reader_t* reader, WriterType& writer, options_t* options, buffer_t* scratch, uint32_t len, bool prefix) {
+    bool ret = base64(reader, writer, options, scratch, len, b64_str, prefix ? strlen(b64_str) : 0);
     mpack_done_bin(reader);
-    free(output);
     return ret;
 }
 
 // Reads MessagePack ext bytes and outputs a JSON base64 string
 template <class WriterType>
-static bool base64_ext(mpack_reader_t* reader, WriterType& writer, options_t* options, int8_t exttype, uint32_t len) {
-    uint32_t new_len = base64_len(len) + strlen(ext_str) + 5 + strlen(b64_str);
-    char* output = (char*)malloc(new_len);
-
-    char* p = output;
-    strcpy(p, ext_str);
-    p += strlen(ext_str);
-    sprintf(p, "%i", exttype);
-    p += strlen(p);
-    *p++ = ':';
-
-    bool ret = base64(reader, writer, options, len, output, p, true);
-
+static bool base64_ext(mpack_reader_t* reader, WriterType& writer, options_t* options, buffer_t* scratch, int8_t exttype, uint32_t len) {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%s%i:%s", ext_str, exttype, b64_str);
+    bool ret = base64(reader, writer, options, scratch, len, prefix, strlen(prefix));
     mpack_done_ext(reader);
-    free(output);
     return ret;
 }
 
@@ -212,32 +298,58 @@ static void describe_ext(mpack_reader_t* reader, int8_t exttype, uint32_t length
     mpack_done_ext(reader);
 }
 
+// Outputs a float or double with the shortest digits that round-trip.
+// Infinities and NaN go through rapidjson so that they fail as before.
 template <class WriterType>
-static bool element(mpack_reader_t* reader, WriterType& writer, options_t* options) {
+static bool number(WriterType& writer, float value) {
+    if (!isfinite(value))
+        return writer.Double((double)value);
+    char buf[JSON_NUMBER_BUFFER_SIZE];
+    return writer.RawValue(buf, json_format_float(value, buf), kNumberType);
+}
+
+template <class WriterType>
+static bool number(WriterType& writer, double value) {
+    if (!isfinite(value))
+        return writer.Double(value);
+    char buf[JSON_NUMBER_BUFFER_SIZE];
+    return writer.RawValue(buf, json_format_double(value, buf), kNumberType);
+}
+
+// Reads a MessagePack element and outputs it as JSON. If stats is not NULL,
+// the element and its children are counted.
+template <class WriterType>
+static bool element(mpack_reader_t* reader, WriterType& writer, options_t* options, buffer_t* scratch, stats_t* stats) {
     const mpack_tag_t tag = mpack_read_tag(reader);
     if (mpack_reader_error(reader) != mpack_ok)
         return false;
 
+    if (stats) {
+        ++stats->types[tag.type];
+        if (options->base64 && (tag.type == mpack_type_bin || tag.type == mpack_type_ext))
+            stats->base64_bytes += tag.v.l;
+    }
+
     switch (tag.type) {
         case mpack_type_bool:   return writer.Bool(tag.v.b);
         case mpack_type_nil:    return writer.Null();
         case mpack_type_int:    return writer.Int64(tag.v.i);
         case mpack_type_uint:   return writer.Uint64(tag.v.u);
-        case mpack_type_float:  return writer.Double((double)tag.v.f);
-        case mpack_type_double: return writer.Double(tag.v.d);
+        case mpack_type_float:  return number(writer, tag.v.f);
+        case mpack_type_double: return number(writer, tag.v.d);
 
         case mpack_type_str:
             return string(reader, writer, options, tag.v.l);
 
         case mpack_type_bin:
             if (options->base64) {
-                return base64_bin(reader, writer, options, tag.v.l, options->base64_prefix);
+                return base64_bin(reader, writer, options, scratch, tag.v.l, options->base64_prefix);
             } else if (options->debug) {
                 char buf[BIN_EXT_DESCRIPTION_LENGTH];
                 describe_bin(reader, tag.v.l, buf, sizeof(buf));
                 return writer.RawValue(buf, strlen(buf), kStringType);
             } else {
-                fprintf(stderr,
+                fprintf(error_output(options),
                         "%s: bin unencodable in JSON. Try debug viewing mode (-d) or base64 mode (-b or -B).\n",
                         options->command);
                 mpack_reader_flag_error(reader, mpack_error_data);
@@ -246,13 +358,13 @@ static bool element(mpack_reader_t* reader, WriterType& writer, options_t* optio
 
         case mpack_type_ext:
             if (options->base64) {
-                return base64_ext(reader, writer, options, tag.exttype, tag.v.l);
+                return base64_ext(reader, writer, options, scratch, tag.exttype, tag.v.l);
             } else if (options->debug) {
                 char buf[BIN_EXT_DESCRIPTION_LENGTH];
                 describe_ext(reader, tag.exttype, tag.v.l, buf, sizeof(buf));
                 return writer.RawValue(buf, strlen(buf), kStringType);
             } else {
-                fprintf(stderr,
+                fprintf(error_output(options),
                         "%s: ext type %i unencodable in JSON. Try debug viewing mode (-d) or base64 mode (-b or -B)\n",
                         options->command, tag.exttype);
                 mpack_reader_flag_error(reader, mpack_error_data);
@@ -263,7 +375,7 @@ static bool element(mpack_reader_t* reader, WriterType& writer, options_t* optio
             if (!writer.StartArray())
                 return false;
             for (size_t i = 0; i < tag.v.l; ++i)
-                if (!element(reader, writer, options))
+                if (!element(reader, writer, options, scratch, stats))
                     return false;
             mpack_done_array(reader);
             return writer.EndArray();
@@ -274,18 +386,18 @@ static bool element(mpack_reader_t* reader, WriterType& writer, options_t* optio
             for (size_t i = 0; i < tag.v.l; ++i) {
 
                 if (options->debug) {
-                    element(reader, writer, options);
+                    element(reader, writer, options, scratch, stats);
                 } else {
                     uint32_t len = mpack_expect_str(reader);
                     if (mpack_reader_error(reader) != mpack_ok) {
-                        fprintf(stderr, "%s: map key is not a string. Try debug viewing mode (-d)\n", options->command);
+                        fprintf(error_output(options), "%s: map key is not a string. Try debug viewing mode (-d)\n", options->command);
                         return false;
                     }
                     if (!string(reader, writer, options, len))
                         return false;
                 }
 
-                if (!element(reader, writer, options))
+                if (!element(reader, writer, options, scratch, stats))
                     return false;
             }
             mpack_done_map(reader);
@@ -295,87 +407,1153 @@ static bool element(mpack_reader_t* reader, WriterType& writer, options_t* optio
     return true;
 }
 
-template <class WriterType>
-static bool convert_all_elements(mpack_reader_t* reader, WriterType& writer, FileWriteStream& stream, options_t* options) {
+// With -e, walks an element, converting only the values that match the
+// selected paths; paths is the mask of those that have matched down to this
+// depth. Each value output is followed by a newline. Everything else is
+// skipped with MPack without decoding strings or numbers, and map keys are
+// only read when they have the length of a key in a path.
+template <class WriterType, class StreamType>
+static bool select_element(mpack_reader_t* reader, WriterType& writer, StreamType& stream, options_t* options,
+        buffer_t* scratch, stats_t* stats, uint64_t paths, size_t depth)
+{
+    const select_t* select = options->select;
+    if (select_ends(select, paths, depth)) {
+        if (!element(reader, writer, options, scratch, stats))
+            return false;
+        stream.Put('\n');
+        return true;
+    }
+
+    mpack_tag_t tag = mpack_peek_tag(reader);
+    if (tag.type != mpack_type_array && tag.type != mpack_type_map) {
+        mpack_discard(reader);
+        return mpack_reader_error(reader) == mpack_ok;
+    }
+    tag = mpack_read_tag(reader);
+
+    if (tag.type == mpack_type_array) {
+        for (uint32_t i = 0; i < tag.v.l; ++i) {
+            uint64_t matched = select_match_index(select, paths, depth, i);
+            if (matched) {
+                if (!select_element(reader, writer, stream, options, scratch, stats, matched, depth + 1))
+                    return false;
+            } else {
+                mpack_discard(reader);
+            }
+        }
+        mpack_done_array(reader);
+        return mpack_reader_error(reader) == mpack_ok;
+    }
+
+    for (uint32_t i = 0; i < tag.v.l; ++i) {
+        if (mpack_peek_tag(reader).type != mpack_type_str) {
+            if (mpack_reader_error(reader) != mpack_ok)
+                return false;
+            if (!options->debug) {
+                fprintf(error_output(options), "%s: map key is not a string. Try debug viewing mode (-d)\n", options->command);
+                mpack_reader_flag_error(reader, mpack_error_data);
+                return false;
+            }
+
+            // only string keys can be selected
+            mpack_discard(reader);
+            mpack_discard(reader);
+            continue;
+        }
+
+        uint32_t len = mpack_expect_str(reader);
+        uint64_t named;
+        uint64_t matched = select_match_key_length(select, paths, depth, len, &named);
+        if (named) {
+            const char* key;
+            if (mpack_should_read_bytes_inplace(reader, len)) {
+                key = mpack_read_bytes_inplace(reader, len);
+            } else {
+                char* buffer = buffer_scratch(scratch, len);
+                if (!buffer) {
+                    mpack_reader_flag_error(reader, mpack_error_memory);
+                    return false;
+                }
+                mpack_read_bytes(reader, buffer, len);
+                key = buffer;
+            }
+            if (mpack_reader_error(reader) != mpack_ok)
+                return false;
+            matched |= select_match_key(select, named, depth, key, len);
+        } else {
+            mpack_skip_bytes(reader, len);
+        }
+        mpack_done_str(reader);
+
+        if (matched) {
+            if (!select_element(reader, writer, stream, options, scratch, stats, matched, depth + 1))
+                return false;
+        } else {
+            mpack_discard(reader);
+        }
+    }
+    mpack_done_map(reader);
+    return mpack_reader_error(reader) == mpack_ok;
+}
+
+// Converts a top-level element, or with -e, the values in it that match the
+// selected paths.
+template <class WriterType, class StreamType>
+static bool record(mpack_reader_t* reader, WriterType& writer, StreamType& stream, options_t* options,
+        buffer_t* scratch, stats_t* stats)
+{
+    if (options->select)
+        return select_element(reader, writer, stream, options, scratch, stats, select_all(options->select), 0);
+    return element(reader, writer, options, scratch, stats);
+}
+
+// Returns true if there may be another top-level element in the input. An
+// EOF error at this point is OK since we're between elements. EOF at any
+// other time fails conversion.
+static bool has_next_element(mpack_reader_t* reader, bool in_memory) {
+
+    // A reader over in-memory data has nothing to fill from when it runs
+    // out, so it flags mpack_error_invalid rather than mpack_error_eof. We
+    // check for remaining data instead.
+    if (in_memory) {
+        const char* data;
+        return mpack_reader_remaining(reader, &data) > 0;
+    }
+
+    mpack_peek_tag(reader);
+    return mpack_reader_error(reader) != mpack_error_eof;
+}
+
+// Returns the number of bytes of input the reader has consumed, offset by a
+// constant; only the difference between two positions is meaningful. For
+// input in memory, bytes_in stays zero and the position wraps around.
+static uint64_t reader_position(mpack_reader_t* reader, const stats_t* stats) {
+    const char* data;
+    return stats->bytes_in - mpack_reader_remaining(reader, &data);
+}
+
+// Outputs the delimiter between top-level elements in continuous mode
+template <class StreamType>
+static void put_delimiter(StreamType& stream, options_t* options) {
+    if (options->continuous_mode == continuous_delimited)
+        stream.Put(options->continuous_mode_delimiter);
+    if (options->pretty)
+        stream.Put('\n');
+}
+
+template <class WriterType, class StreamType>
+static bool convert_all_elements(mpack_reader_t* reader, WriterType& writer, StreamType& stream, options_t* options,
+        buffer_t* scratch, stats_t* stats, bool in_memory)
+{
     do {
-        // Convert an element
-        if (!element(reader, writer, options))
+        // The record's latency doesn't include the time spent waiting for
+        // its input.
+        double start = 0;
+        double read_seconds = 0;
+        uint64_t position = 0;
+        if (options->histogram) {
+            start = stats_now();
+            read_seconds = stats->read_seconds;
+            position = reader_position(reader, stats);
+        }
+
+        // Convert an element. If the output has failed, we stop; the caller
+        // reports the write error.
+        if (!record(reader, writer, stream, options, scratch, stats))
             return false;
+        if (stream.error)
+            return true;
+        if (stats)
+            ++stats->records;
+        if (options->histogram)
+            stats_record(stats, start, stats->read_seconds - read_seconds, reader_position(reader, stats) - position);
+
+        // In unbuffered mode each element is output as soon as it has been
+        // converted rather than when the buffer fills up.
+        if (options->unbuffered)
+            stream.FlushFile();
 
         // If we're not in continuous mode, we're done
         if (options->continuous_mode == continuous_off)
             return true;
 
-        // See if there's more. An EOF error at this point is OK since we're
-        // between elements. EOF at any other time fails conversion.
-        mpack_peek_tag(reader);
-        if (mpack_reader_error(reader) == mpack_error_eof)
+        // See if there's more
+        if (!has_next_element(reader, in_memory))
             return true;
 
-        // Output a delimiter
-        if (options->continuous_mode == continuous_delimited)
-            stream.Put(options->continuous_mode_delimiter);
-        if (options->pretty)
-            stream.Put('\n');
+        // Selected values are each followed by a newline instead.
+        if (!options->select)
+            put_delimiter(stream, options);
     } while (true);
 }
 
-static bool convert(options_t* options) {
+// Stream input from a file or stdin. If stats is not NULL, we count the
+// bytes read and the time spent waiting for them.
+//
+// We use read() rather than fread() so that a fill returns whatever is
+// available on a pipe instead of blocking until the reader's buffer is full.
+// MPack fills again if it needs more, and an element arriving on a pipe can
+// be converted as soon as its last byte does.
+//
+// With -a, input is instead prefetched on a reader thread (see asyncio.h.)
+typedef struct input_t {
+    int fd;
+    stats_t* stats;
+    async_reader_t* async;
+} input_t;
+
+static bool open_input(options_t* options, input_t* input, stats_t* stats) {
+    input->fd = options->in_filename ? open(options->in_filename, O_RDONLY) : STDIN_FILENO;
+    input->stats = stats;
+    input->async = NULL;
+    if (input->fd == -1) {
+        fprintf(stderr, "%s: could not open \"%s\" for reading.\n", options->command, options->in_filename);
+        return false;
+    }
+
+    if (options->async_block_size) {
+        input->async = (async_reader_t*)malloc(sizeof(async_reader_t));
+        if (!input->async || !async_reader_start(input->async, input->fd, options->async_block_size)) {
+            fprintf(stderr, "%s: could not start reader thread\n", options->command);
+            free(input->async);
+            if (input->fd != STDIN_FILENO)
+                close(input->fd);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void close_input(input_t* input) {
+    if (input->async) {
+        async_reader_stop(input->async);
+        free(input->async);
+    }
+    if (input->fd != STDIN_FILENO)
+        close(input->fd);
+}
+
+static size_t input_read(mpack_reader_t* reader, input_t* input, char* buffer, size_t count) {
+    double start = input->stats ? stats_now() : 0;
+    ssize_t n;
+    if (input->async) {
+        n = (ssize_t)async_read(input->async, buffer, count);
+        if (n == 0 && input->async->error)
+            n = -1;
+    } else {
+        do {
+            n = read(input->fd, buffer, count);
+        } while (n < 0 && errno == EINTR);
+    }
+    if (input->stats) {
+        input->stats->read_seconds += stats_now() - start;
+        if (n > 0)
+            input->stats->bytes_in += (size_t)n;
+    }
+    if (n <= 0) {
+        mpack_reader_flag_error(reader, n < 0 ? mpack_error_io : mpack_error_eof);
+        return 0;
+    }
+    return (size_t)n;
+}
+
+static size_t input_fill(mpack_reader_t* reader, char* buffer, size_t count) {
+    return input_read(reader, (input_t*)reader->context, buffer, count);
+}
+
+// Converts everything the reader contains to the stream, with a newline
+// after pretty-printed output. Returns false on a parse error.
+template <class StreamType>
+static bool convert_reader(mpack_reader_t* reader, StreamType& stream, options_t* options, buffer_t* scratch,
+        stats_t* stats, bool in_memory)
+{
+    bool ret;
+    if (options->pretty) {
+        {
+            JsonWriter<PrettyWriter<StreamType>, StreamType> writer(stream);
+            ret = convert_all_elements(reader, writer, stream, options, scratch, stats, in_memory);
+        }
+
+        // RapidJSON's PrettyWriter does not add a final
+        // newline at the end of the JSON
+        if (!options->select)
+            stream.Put('\n');
+
+    } else {
+        JsonWriter<Writer<StreamType>, StreamType> writer(stream);
+        ret = convert_all_elements(reader, writer, stream, options, scratch, stats, in_memory);
+    }
+    stream.Flush();
+    return ret;
+}
+
+static bool convert_serial(options_t* options, FILE* out_file, const mapped_file_t* mapped, stats_t* stats) {
+    workspace_t* workspace = options->workspace;
 
     // Open input file with MPack
     mpack_reader_t reader;
-    if (options->in_filename)
-        mpack_reader_init_file(&reader, options->in_filename);
-    else
-        mpack_reader_init_stdfile(&reader, stdin, true);
+    input_t input;
+    char* reader_buffer = NULL;
+    if (mapped) {
+        mpack_reader_init_data(&reader, mapped->data, mapped->size);
+    } else {
+        if (!open_input(options, &input, stats))
+            return false;
+        reader_buffer = workspace ? workspace->reader_buffer : (char*)malloc(BUFFER_SIZE);
+        mpack_reader_init(&reader, reader_buffer, BUFFER_SIZE, 0);
+        mpack_reader_set_context(&reader, &input);
+        mpack_reader_set_fill(&reader, input_fill);
+    }
 
-    // Open output file for RapidJSON
-    static FILE* out_file = NULL;
-    if (options->out_filename) {
-        out_file = fopen(options->out_filename, "wb");
-        if (out_file == NULL) {
-            fprintf(stderr, "%s: could not open \"%s\" for writing.\n", options->command, options->out_filename);
+    // scratch space for base64, reused for each string
+    buffer_t local_scratch = {NULL, 0, 0};
+    buffer_t* scratch = workspace ? &workspace->scratch : &local_scratch;
+
+    // With -a, output is written on a writer thread
+    async_writer_t async;
+    char* buffer = NULL;
+    if (options->async_block_size) {
+        if (!async_writer_start(&async, out_file, options->async_block_size)) {
+            fprintf(stderr, "%s: could not start writer thread\n", options->command);
             mpack_reader_destroy(&reader);
+            if (!mapped) {
+                close_input(&input);
+                if (!workspace)
+                    free(reader_buffer);
+            }
             return false;
         }
     } else {
-        out_file = stdout;
+        buffer = workspace ? workspace->output_buffer : (char*)malloc(BUFFER_SIZE);
     }
 
     bool ret;
-    char* buffer = (char*)malloc(BUFFER_SIZE);
+    bool write_error;
     {
-        FileWriteStream stream(out_file, buffer, BUFFER_SIZE);
+        FileStream stream = options->async_block_size ? FileStream(&async, stats) :
+                FileStream(out_file, buffer, BUFFER_SIZE, stats);
+        ret = convert_reader(&reader, stream, options, scratch, stats, mapped != NULL);
+        write_error = stream.error;
+    }
 
-        if (options->pretty) {
-            {
-                PrettyWriter<FileWriteStream> writer(stream);
-                ret = convert_all_elements(&reader, writer, stream, options);
+    if (options->async_block_size && !async_writer_stop(&async))
+        write_error = true;
+    if (!workspace)
+        free(buffer);
+    buffer_destroy(&local_scratch);
+    mpack_error_t error = mpack_reader_destroy(&reader);
+    if (!mapped) {
+        close_input(&input);
+        if (!workspace)
+            free(reader_buffer);
+    }
+
+    if (!ret)
+        fprintf(stderr, "%s: parse error: %s (%i)\n", options->command,
+                mpack_error_to_string(error), (int)error);
+    if (write_error) {
+        fprintf(stderr, "%s: error writing output\n", options->command);
+        ret = false;
+    }
+    return ret;
+}
+
+// With -V, the input is checked without being converted: the structure and
+// lengths of all values, that strings are valid UTF-8, that map keys are
+// strings (unless -d), and that there are no bin or ext objects (unless -d,
+// -b or -B). This is stricter than conversion, which doesn't check UTF-8, so
+// some input that converts without error is rejected.
+//
+// Values are validated iteratively, with the open containers on a stack, so
+// deeply nested input can't overflow the call stack.
+
+typedef struct validate_frame_t {
+    uint64_t remaining; // values left, counting map keys and values separately
+    bool map;
+} validate_frame_t;
+
+// Reads a string and checks that it is valid UTF-8. position is the offset
+// of its first byte in the input. On error, position is set to the offset
+// of the error.
+static bool validate_string(mpack_reader_t* reader, uint32_t len, uint64_t* position, const char** message) {
+    utf8_state_t state = {0, 0, 0};
+    size_t error;
+    if (mpack_should_read_bytes_inplace(reader, len)) {
+        const char* str = mpack_read_bytes_inplace(reader, len);
+        if (mpack_reader_error(reader) != mpack_ok) {
+            *message = "truncated string";
+            return false;
+        }
+        if (!utf8_validate(&state, str, len, &error)) {
+            *message = "string is not valid UTF-8";
+            *position += error;
+            return false;
+        }
+    } else {
+        for (uint32_t done = 0; done < len;) {
+            char buf[4096];
+            uint32_t count = (len - done < sizeof(buf)) ? len - done : sizeof(buf);
+            mpack_read_bytes(reader, buf, count);
+            if (mpack_reader_error(reader) != mpack_ok) {
+                *message = "truncated string";
+                return false;
+            }
+            if (!utf8_validate(&state, buf, count, &error)) {
+                *message = "string is not valid UTF-8";
+                *position += done + error;
+                return false;
             }
+            done += count;
+        }
+    }
+    if (!utf8_complete(&state)) {
+        *message = "string is not valid UTF-8";
+        *position += len;
+        return false;
+    }
+    mpack_done_str(reader);
+    return true;
+}
 
-            // RapidJSON's PrettyWriter does not add a final
-            // newline at the end of the JSON
-            stream.Put('\n');
-            stream.Flush();
+// Validates a top-level element. origin is the reader's position at the
+// start of the input. On error, message and position describe it.
+static bool validate_element(mpack_reader_t* reader, options_t* options, buffer_t* stack, stats_t* stats,
+        uint64_t origin, const char** message, uint64_t* position)
+{
+    stack->size = 0;
+    do {
+        validate_frame_t* top = stack->size ? (validate_frame_t*)(stack->data + stack->size) - 1 : NULL;
+        bool key = top && top->map && top->remaining % 2 == 0;
+        if (top)
+            --top->remaining;
 
-        } else {
-            Writer<FileWriteStream> writer(stream);
-            ret = convert_all_elements(&reader, writer, stream, options);
+        *position = reader_position(reader, stats) - origin;
+        mpack_tag_t tag = mpack_read_tag(reader);
+        if (mpack_reader_error(reader) != mpack_ok) {
+            *message = mpack_reader_error(reader) == mpack_error_io ? "error reading input" :
+                    "invalid type or truncated data";
+            return false;
+        }
+        ++stats->types[tag.type];
+        if (key && tag.type != mpack_type_str && !options->debug) {
+            *message = "map key is not a string";
+            return false;
         }
+
+        switch (tag.type) {
+            case mpack_type_str:
+                *position = reader_position(reader, stats) - origin;
+                if (!validate_string(reader, tag.v.l, position, message))
+                    return false;
+                break;
+
+            case mpack_type_bin:
+            case mpack_type_ext:
+                if (!options->base64 && !options->debug) {
+                    *message = tag.type == mpack_type_bin ? "bin is unencodable in JSON without -b or -B" :
+                            "ext is unencodable in JSON without -b or -B";
+                    return false;
+                }
+                mpack_skip_bytes(reader, tag.v.l);
+                if (mpack_reader_error(reader) != mpack_ok) {
+                    *message = "truncated bin or ext";
+                    return false;
+                }
+                if (tag.type == mpack_type_bin)
+                    mpack_done_bin(reader);
+                else
+                    mpack_done_ext(reader);
+                break;
+
+            case mpack_type_array:
+            case mpack_type_map: {
+                validate_frame_t frame;
+                frame.remaining = tag.type == mpack_type_map ? (uint64_t)tag.v.l * 2 : tag.v.l;
+                frame.map = tag.type == mpack_type_map;
+                if (!buffer_append(stack, (const char*)&frame, sizeof(frame))) {
+                    *message = "allocation failure";
+                    return false;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // close the containers that are complete
+        while (stack->size > 0) {
+            top = (validate_frame_t*)(stack->data + stack->size) - 1;
+            if (top->remaining > 0)
+                break;
+            if (top->map)
+                mpack_done_map(reader);
+            else
+                mpack_done_array(reader);
+            stack->size -= sizeof(validate_frame_t);
+        }
+    } while (stack->size > 0);
+    return true;
+}
+
+// Validates all top-level elements of the input. Outside of continuous mode,
+// there must be exactly one. base is the offset of the mapped data in the
+// file (with -r), so that errors are reported at their offset in the file.
+static bool validate_file(options_t* options, const mapped_file_t* mapped, uint64_t base, stats_t* stats) {
+    workspace_t* workspace = options->workspace;
+
+    // The reader position needs the bytes read, so we always count them.
+    stats_t local_stats;
+    memset(&local_stats, 0, sizeof(local_stats));
+    stats_t* counters = stats ? stats : &local_stats;
+
+    mpack_reader_t reader;
+    input_t input;
+    char* reader_buffer = NULL;
+    if (mapped) {
+        mpack_reader_init_data(&reader, mapped->data, mapped->size);
+    } else {
+        if (!open_input(options, &input, counters))
+            return false;
+        reader_buffer = workspace ? workspace->reader_buffer : (char*)malloc(BUFFER_SIZE);
+        if (!reader_buffer) {
+            fprintf(stderr, "%s: allocation failure\n", options->command);
+            close_input(&input);
+            return false;
+        }
+        mpack_reader_init(&reader, reader_buffer, BUFFER_SIZE, 0);
+        mpack_reader_set_context(&reader, &input);
+        mpack_reader_set_fill(&reader, input_fill);
+    }
+
+    buffer_t stack = {NULL, 0, 0};
+    uint64_t origin = reader_position(&reader, counters);
+    const char* message = NULL;
+    uint64_t position = 0;
+    do {
+        double start = 0;
+        double read_seconds = 0;
+        uint64_t record_position = 0;
+        if (options->histogram) {
+            start = stats_now();
+            read_seconds = counters->read_seconds;
+            record_position = reader_position(&reader, counters);
+        }
+
+        if (!validate_element(&reader, options, &stack, counters, origin, &message, &position))
+            break;
+        ++counters->records;
+        if (options->histogram)
+            stats_record(counters, start, counters->read_seconds - read_seconds, reader_position(&reader, counters) - record_position);
+
+        if (!has_next_element(&reader, mapped != NULL))
+            break;
+        if (options->continuous_mode == continuous_off) {
+            position = reader_position(&reader, counters) - origin;
+            message = "unexpected data after the top-level object (use -c for a stream of objects)";
+        }
+    } while (!message);
+
+    buffer_destroy(&stack);
+    mpack_reader_destroy(&reader);
+    if (!mapped) {
+        close_input(&input);
+        if (!workspace)
+            free(reader_buffer);
+    }
+
+    if (message)
+        fprintf(stderr, "%s: invalid MessagePack at offset %llu: %s\n", options->command,
+                (unsigned long long)(base + position), message);
+    return message == NULL;
+}
+
+// In parallel continuous mode, the main thread finds the boundaries of
+// top-level elements by skipping over them with MPack, and hands off runs of
+// whole elements as jobs to be converted on worker threads.
+
+template <class WriterType, class StreamType>
+static bool convert_job_elements(mpack_reader_t* reader, WriterType& writer, StreamType& stream, options_t* options,
+        parallel_job_t* job, stats_t* stats)
+{
+    for (size_t i = 0; i < job->count; ++i) {
+        // Delimiters go before each element except the first in the input
+        if ((job->index > 0 || i > 0) && !options->select)
+            put_delimiter(stream, options);
+
+        double start = 0;
+        uint64_t position = 0;
+        if (options->histogram) {
+            start = stats_now();
+            position = reader_position(reader, stats);
+        }
+        if (!record(reader, writer, stream, options, &job->scratch, stats))
+            return false;
+        if (stats)
+            ++stats->records;
+        if (options->histogram)
+            stats_record(stats, start, 0, reader_position(reader, stats) - position);
+    }
+    return true;
+}
+
+// A single top-level array in memory can also be converted in parallel. The
+// main thread skips over the array's children to split it into slices, and
+// each job converts a slice of children as though it were inside the array
+// so that they are indented correctly when pretty-printing. The main thread
+// writes the brackets, and each slice after the first starts with a comma.
+template <class WriterType, class StreamType>
+static bool convert_slice_elements(mpack_reader_t* reader, WriterType& writer, StreamType& stream, options_t* options,
+        parallel_job_t* job, stats_t* stats)
+{
+    writer.StartArray();
+    job->output.size = 0; // drop the opening bracket
+    if (job->index > 0)
+        stream.Put(',');
+
+    for (size_t i = 0; i < job->count; ++i)
+        if (!element(reader, writer, options, &job->scratch, stats))
+            return false;
+    return true;
+}
+
+template <bool slice>
+static bool convert_job(void* context, parallel_job_t* job) {
+    options_t job_options = *(options_t*)context;
+    job_options.error_file = job->error_file;
+    options_t* options = &job_options;
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, job->data, job->size);
+    BufferStream stream(&job->output);
+    stats_t* stats = (options->stats || options->histogram) ? &job->stats : NULL;
+
+    bool ret;
+    if (options->pretty) {
+        JsonWriter<PrettyWriter<BufferStream>, BufferStream> writer(stream);
+        ret = slice ? convert_slice_elements(&reader, writer, stream, options, job, stats) :
+                convert_job_elements(&reader, writer, stream, options, job, stats);
+    } else {
+        JsonWriter<Writer<BufferStream>, BufferStream> writer(stream);
+        ret = slice ? convert_slice_elements(&reader, writer, stream, options, job, stats) :
+                convert_job_elements(&reader, writer, stream, options, job, stats);
     }
 
-    free(buffer);
     mpack_error_t error = mpack_reader_destroy(&reader);
-    fclose(out_file);
+    if (!ret) {
+        fprintf(error_output(options), "%s: parse error: %s (%i)\n", options->command,
+                mpack_error_to_string(error), (int)error);
+        return false;
+    }
+    if (stream.error) {
+        fprintf(error_output(options), "%s: allocation failure\n", options->command);
+        return false;
+    }
+    return true;
+}
 
-    if (!ret)
+// Stream input for the parallel splitter. The reader's fill function keeps a
+// copy of everything it reads in a window so that the raw bytes of elements
+// can be handed off to workers.
+typedef struct capture_t {
+    input_t input;
+    buffer_t window;      // input from window_offset onwards
+    size_t window_offset;
+    size_t total;         // total bytes read
+} capture_t;
+
+static size_t capture_fill(mpack_reader_t* reader, char* buffer, size_t count) {
+    capture_t* capture = (capture_t*)reader->context;
+    size_t n = input_read(reader, &capture->input, buffer, count);
+    if (n == 0)
+        return 0;
+    if (!buffer_append(&capture->window, buffer, n)) {
+        mpack_reader_flag_error(reader, mpack_error_memory);
+        return 0;
+    }
+    capture->total += n;
+    return n;
+}
+
+// Hands off the input from start to end, containing count whole elements, as
+// a job. Returns false if a job has failed or on allocation failure.
+static bool submit_job(parallel_t* parallel, options_t* options, const mapped_file_t* mapped, capture_t* capture,
+        size_t start, size_t end, size_t count)
+{
+    parallel_job_t* job = parallel_next_job(parallel);
+    if (!job)
+        return false;
+
+    job->size = end - start;
+    job->offset = start;
+    job->count = count;
+
+    if (mapped) {
+        job->data = mapped->data + start;
+    } else {
+        // The job takes ownership of the window. A new window starts with
+        // whatever the reader has read past the end of the job.
+        buffer_t window = {NULL, 0, 0};
+        size_t tail = capture->total - end;
+        if (tail > 0 && !buffer_append(&window, capture->window.data + (end - capture->window_offset), tail)) {
+            fprintf(stderr, "%s: allocation failure\n", options->command);
+            return false;
+        }
+        job->owned = capture->window.data;
+        job->data = capture->window.data + (start - capture->window_offset);
+        capture->window = window;
+        capture->window_offset = end;
+    }
+
+    parallel_submit(parallel);
+    return true;
+}
+
+// The main thread counts its reads in its own stats since the writer thread
+// updates the totals until parallel_finish() returns.
+static bool convert_parallel(options_t* options, FILE* out_file, const mapped_file_t* mapped, stats_t* stats) {
+    mpack_reader_t reader;
+    capture_t capture;
+    memset(&capture, 0, sizeof(capture));
+    char* reader_buffer = NULL;
+    stats_t read_stats;
+    memset(&read_stats, 0, sizeof(read_stats));
+
+    if (mapped) {
+        mpack_reader_init_data(&reader, mapped->data, mapped->size);
+    } else {
+        if (!open_input(options, &capture.input, stats ? &read_stats : NULL))
+            return false;
+        reader_buffer = (char*)malloc(BUFFER_SIZE);
+        if (!reader_buffer) {
+            fprintf(stderr, "%s: allocation failure\n", options->command);
+            close_input(&capture.input);
+            return false;
+        }
+        mpack_reader_init(&reader, reader_buffer, BUFFER_SIZE, 0);
+        mpack_reader_set_context(&reader, &capture);
+        mpack_reader_set_fill(&reader, capture_fill);
+    }
+
+    parallel_t parallel;
+    bool ok = parallel_start(&parallel, options->threads, convert_job<false>, options, out_file, stats,
+            options->unbuffered);
+    if (!ok)
+        fprintf(stderr, "%s: could not start threads\n", options->command);
+
+    // Split the input into jobs of whole elements
+    bool split_error = false;
+    bool submit_error = false;
+    if (ok) {
+        size_t start = 0;
+        size_t count = 0;
+        do {
+            mpack_discard(&reader);
+            if (mpack_reader_error(&reader) != mpack_ok) {
+                split_error = true;
+                break;
+            }
+            ++count;
+
+            const char* data;
+            size_t end = (mapped ? mapped->size : capture.total) - mpack_reader_remaining(&reader, &data);
+            // In unbuffered mode each element is a job of its own so that
+            // it is output as soon as possible.
+            if (end - start >= PARALLEL_JOB_SIZE || options->unbuffered) {
+                if (!submit_job(&parallel, options, mapped, &capture, start, end, count)) {
+                    submit_error = true;
+                    break;
+                }
+                start = end;
+                count = 0;
+            }
+        } while (has_next_element(&reader, mapped != NULL));
+
+        if (!split_error && !submit_error && count > 0) {
+            const char* data;
+            size_t end = (mapped ? mapped->size : capture.total) - mpack_reader_remaining(&reader, &data);
+            submit_error = !submit_job(&parallel, options, mapped, &capture, start, end, count);
+        }
+
+        ok = parallel_finish(&parallel) && !split_error && !submit_error;
+        if (parallel.write_error)
+            fprintf(stderr, "%s: error writing output\n", options->command);
+
+        // RapidJSON's PrettyWriter does not add a final
+        // newline at the end of the JSON
+        if (options->pretty && !options->select)
+            fputc('\n', out_file);
+    }
+
+    mpack_error_t error = mpack_reader_destroy(&reader);
+    if (split_error)
         fprintf(stderr, "%s: parse error: %s (%i)\n", options->command,
                 mpack_error_to_string(error), (int)error);
+
+    if (!mapped) {
+        close_input(&capture.input);
+        buffer_destroy(&capture.window);
+        free(reader_buffer);
+    }
+    if (stats)
+        stats_add(stats, &read_stats);
+    return ok;
+}
+
+// Returns true if the input in memory starts with an array.
+static bool starts_with_array(const mapped_file_t* mapped) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, mapped->data, mapped->size);
+    mpack_tag_t tag = mpack_peek_tag(&reader);
+    mpack_reader_destroy(&reader);
+    return tag.type == mpack_type_array;
+}
+
+static bool convert_array_parallel(options_t* options, FILE* out_file, const mapped_file_t* mapped, stats_t* stats) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, mapped->data, mapped->size);
+    uint32_t count = mpack_expect_array(&reader);
+
+    parallel_t parallel;
+    bool ok = parallel_start(&parallel, options->threads, convert_job<true>, options, out_file, stats, false);
+    if (!ok)
+        fprintf(stderr, "%s: could not start threads\n", options->command);
+
+    // The writer thread doesn't touch the file until the first job is
+    // submitted, so the opening bracket goes out first. The brackets are
+    // counted once the writer thread is done with the stats.
+    size_t bracket_bytes = 0;
+    if (ok) {
+        fputc('[', out_file);
+        ++bracket_bytes;
+    }
+
+    // Split the children of the array into slices
+    bool split_error = false;
+    bool submit_error = false;
+    if (ok) {
+        const char* data;
+        size_t start = mapped->size - mpack_reader_remaining(&reader, &data);
+        size_t elements = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            mpack_discard(&reader);
+            if (mpack_reader_error(&reader) != mpack_ok) {
+                split_error = true;
+                break;
+            }
+            ++elements;
+
+            size_t end = mapped->size - mpack_reader_remaining(&reader, &data);
+            if (end - start >= PARALLEL_JOB_SIZE || i == count - 1) {
+                if (!submit_job(&parallel, options, mapped, NULL, start, end, elements)) {
+                    submit_error = true;
+                    break;
+                }
+                start = end;
+                elements = 0;
+            }
+        }
+        if (!split_error && !submit_error)
+            mpack_done_array(&reader);
+
+        ok = parallel_finish(&parallel) && !split_error && !submit_error;
+        if (parallel.write_error)
+            fprintf(stderr, "%s: error writing output\n", options->command);
+
+        if (ok) {
+            if (options->pretty && count > 0) {
+                fputs("\n]", out_file);
+                bracket_bytes += 2;
+            } else {
+                fputc(']', out_file);
+                ++bracket_bytes;
+            }
+        }
+
+        // RapidJSON's PrettyWriter does not add a final
+        // newline at the end of the JSON
+        if (options->pretty) {
+            fputc('\n', out_file);
+            ++bracket_bytes;
+        }
+    }
+
+    // The workers count the children; the array itself is counted here.
+    if (stats) {
+        ++stats->records;
+        ++stats->types[mpack_type_array];
+        stats->bytes_out += bracket_bytes;
+    }
+
+    mpack_error_t error = mpack_reader_destroy(&reader);
+    if (split_error)
+        fprintf(stderr, "%s: parse error: %s (%i)\n", options->command,
+                mpack_error_to_string(error), (int)error);
+    return ok;
+}
+
+// With -I, builds the index of the input if it is missing or stale. With -r,
+// finds the records in the range, using the index if there is one and
+// skipping over the records before them otherwise. The records are returned
+// as a view into the mapped input.
+static bool find_records(options_t* options, const mapped_file_t* mapped, mapped_file_t* view) {
+    index_t index;
+    bool indexed = false;
+    if (options->index_filename) {
+        struct stat st;
+        if (stat(options->in_filename, &st) != 0) {
+            fprintf(stderr, "%s: could not stat \"%s\".\n", options->command, options->in_filename);
+            return false;
+        }
+        if (!index_read(&index, options->index_filename) || !index_matches(&index, &st)) {
+            index_destroy(&index);
+            if (!index_build(&index, mapped->data, mapped->size, &st)) {
+                fprintf(stderr, "%s: parse error while indexing \"%s\"\n", options->command, options->in_filename);
+                index_destroy(&index);
+                return false;
+            }
+            if (!index_write(&index, options->index_filename)) {
+                fprintf(stderr, "%s: could not write index \"%s\"\n", options->command, options->index_filename);
+                index_destroy(&index);
+                return false;
+            }
+        }
+        indexed = true;
+    }
+
+    bool ok = true;
+    size_t first = 0;
+    size_t last = 0;
+    if (options->has_range) {
+        const record_range_t* range = &options->range;
+        if (indexed) {
+            ok = index_seek(&index, mapped->data, mapped->size, range->first, &first) &&
+                    index_seek(&index, mapped->data, mapped->size, range->last, &last);
+        } else {
+            ok = index_skip(mapped->data, mapped->size, 0, range->first, &first) &&
+                    index_skip(mapped->data, mapped->size, first, range->last - range->first, &last);
+        }
+        if (!ok)
+            fprintf(stderr, "%s: parse error while seeking to records\n", options->command);
+    }
+    if (indexed)
+        index_destroy(&index);
+
+    view->data = mapped->data + first;
+    view->size = last - first;
+    return ok;
+}
+
+// Converts the input file to the output file. If stats is not NULL, the
+// counters are added to it.
+static bool convert_file(options_t* options, stats_t* stats) {
+    double start = stats ? stats_now() : 0;
+    double io_seconds = stats ? stats->read_seconds + stats->write_seconds : 0;
+
+    // If the input is a regular file we map it into memory so that all
+    // strings can be read in-place.
+    mapped_file_t mapped;
+    bool in_memory = options->in_filename && map_file(options->in_filename, &mapped);
+
+    // With -I or -r, we convert only a range of records, if any.
+    mapped_file_t view = {NULL, 0};
+    if (in_memory)
+        view = mapped;
+    if (options->index_filename || options->has_range) {
+        if (!in_memory) {
+            fprintf(stderr, "%s: -I and -r require a non-empty input file given with -i\n", options->command);
+            return false;
+        }
+        if (!find_records(options, &mapped, &view)) {
+            unmap_file(&mapped);
+            return false;
+        }
+
+        // -I alone only builds the index
+        if (!options->has_range) {
+            unmap_file(&mapped);
+            return true;
+        }
+    }
+
+    // Open output file for RapidJSON
+    FILE* out_file = NULL;
+    if (options->validate) {
+        // no output
+    } else if (options->out_filename) {
+        out_file = fopen(options->out_filename, "wb");
+        if (out_file == NULL) {
+            fprintf(stderr, "%s: could not open \"%s\" for writing.\n", options->command, options->out_filename);
+            if (in_memory)
+                unmap_file(&mapped);
+            return false;
+        }
+    } else {
+        out_file = stdout;
+    }
+
+    bool ret;
+    bool serial = false;
+    if (in_memory && view.size == 0) {
+        ret = true; // a range past the end of the input
+    } else if (options->validate) {
+        ret = validate_file(options, in_memory ? &view : NULL, in_memory ? (uint64_t)(view.data - mapped.data) : 0,
+                stats);
+        serial = true;
+    } else if (options->threads > 1 && options->continuous_mode != continuous_off) {
+        ret = convert_parallel(options, out_file, in_memory ? &view : NULL, stats);
+    } else if (options->threads > 1 && in_memory && !options->select && starts_with_array(&view)) {
+        ret = convert_array_parallel(options, out_file, &view, stats);
+    } else {
+        ret = convert_serial(options, out_file, in_memory ? &view : NULL, stats);
+        serial = true;
+    }
+
+    if (in_memory) {
+        if (stats)
+            stats->bytes_in += view.size;
+        unmap_file(&mapped);
+    }
+    if (out_file)
+        fclose(out_file);
+
+    // Serial conversion is whatever time isn't spent reading or writing.
+    if (stats && serial)
+        stats->convert_seconds += stats_now() - start - (stats->read_seconds + stats->write_seconds - io_seconds);
     return ret;
 }
 
+static void report(options_t* options, const stats_t* stats, double start) {
+    stats_stop_reporter();
+    if (options->stats)
+        stats_report(options->command, options->stats, stats, stats_now() - start);
+    if (options->histogram)
+        stats_report_histograms(options->command, options->stats == stats_json ? stats_json : stats_text, stats);
+}
+
+static bool convert(options_t* options) {
+    stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats_t* counters = (options->stats || options->histogram) ? &stats : NULL;
+    double start = stats_now();
+    if (options->histogram)
+        stats_start_reporter(options->command, options->stats == stats_json ? stats_json : stats_text, &stats);
+
+    bool ret = convert_file(options, counters);
+    report(options, &stats, start);
+    return ret;
+}
+
+// Each worker counts a file in its workspace's stats and adds them to the
+// totals when the file is done, so SIGUSR1 prints the histograms of the files
+// finished so far.
+typedef struct batch_context_t {
+    options_t* options;
+    workspace_t* workspaces;
+    bool counting;
+    pthread_mutex_t mutex;
+    stats_t totals;
+} batch_context_t;
+
+static bool convert_batch_file(void* context, size_t worker, const char* in_filename, const char* out_filename) {
+    batch_context_t* batch = (batch_context_t*)context;
+    workspace_t* workspace = &batch->workspaces[worker];
+
+    options_t options = *batch->options;
+    options.in_filename = in_filename;
+    options.out_filename = out_filename;
+    options.threads = 1;
+    options.workspace = workspace;
+
+    stats_t* stats = NULL;
+    if (batch->counting) {
+        stats = &workspace->stats;
+        memset(stats, 0, sizeof(*stats));
+    }
+    bool ok = convert_file(&options, stats);
+    if (stats) {
+        pthread_mutex_lock(&batch->mutex);
+        stats_add(&batch->totals, stats);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: failed to %s \"%s\"\n", options.command, options.validate ? "validate" : "convert",
+                in_filename);
+        return false;
+    }
+    return true;
+}
+
+// Converts every file in the batch, one file per worker thread at a time.
+// Statistics and histograms are the totals over all files, printed at exit.
+static bool convert_batch(options_t* options, batch_t* batch) {
+    double start = stats_now();
+    size_t threads = options->threads ? options->threads : 1;
+    batch_context_t context;
+    memset(&context, 0, sizeof(context));
+    context.options = options;
+    context.counting = options->stats || options->histogram;
+    pthread_mutex_init(&context.mutex, NULL);
+    if (options->histogram)
+        stats_start_reporter(options->command, options->stats == stats_json ? stats_json : stats_text,
+                &context.totals);
+    context.workspaces = (workspace_t*)calloc(threads, sizeof(workspace_t));
+    bool ok = context.workspaces != NULL;
+    for (size_t i = 0; ok && i < threads; ++i) {
+        context.workspaces[i].reader_buffer = (char*)malloc(BUFFER_SIZE);
+        context.workspaces[i].output_buffer = (char*)malloc(BUFFER_SIZE);
+        ok = context.workspaces[i].reader_buffer && context.workspaces[i].output_buffer;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: allocation failure\n", options->command);
+    } else {
+        ok = batch_run(batch, threads, convert_batch_file, &context);
+    }
+
+    if (context.workspaces) {
+        for (size_t i = 0; i < threads; ++i) {
+            workspace_t* workspace = &context.workspaces[i];
+            free(workspace->reader_buffer);
+            free(workspace->output_buffer);
+            buffer_destroy(&workspace->scratch);
+        }
+        free(context.workspaces);
+    }
+
+    pthread_mutex_destroy(&context.mutex);
+    report(options, &context.totals, start);
+    return ok;
+}
+
+static void parse_threads(options_t* options) {
+    const char* arg = optarg;
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value <= 0 || value > PARALLEL_MAX_THREADS) {
+        fprintf(stderr, "%s: -j requires a thread count between 1 and %i, not \"%s\"\n", options->command, PARALLEL_MAX_THREADS, arg);
+        exit(EXIT_FAILURE);
+    }
+    options->threads = (size_t)value;
+}
+
+static void parse_block_size(options_t* options) {
+    const char* arg = optarg;
+    char* end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value < ASYNC_MIN_BLOCK_KB || value > ASYNC_MAX_BLOCK_KB) {
+        fprintf(stderr, "%s: -a requires a block size between %i and %i KiB, not \"%s\"\n", options->command,
+                ASYNC_MIN_BLOCK_KB, ASYNC_MAX_BLOCK_KB, arg);
+        exit(EXIT_FAILURE);
+    }
+    options->async_block_size = (size_t)value * 1024;
+}
+
 static void usage(const char* command) {
-    fprintf(stderr, "Usage: %s [-dpbB] [-i <infile>] [-o <outfile>]\n", command);
+    fprintf(stderr, "Usage: %s [-dpbB] [-cCuV] [-sSH] [-x <delimiter>] [-e <path>] [-I <index>] [-r <range>] [-j <threads>] [-a <block-kb>] [-i <infile>] [-o <outfile>]\n", command);
+    fprintf(stderr, "       %s [options] [-L] [-O <template>] [<infile>...]\n", command);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -i <infile>  Input filename (default stdin)\n");
     fprintf(stderr, "    -o <outfile>  Output filename (default stdout)\n");
@@ -386,6 +1564,23 @@ static void usage(const char* command) {
     fprintf(stderr, "    -c  Continuous mode, no delimiter\n");
     fprintf(stderr, "    -C  Continuous mode, comma delimited\n");
     fprintf(stderr, "    -x <delimiter>  Continuous mode, specified delimiter\n");
+    fprintf(stderr, "    -e <path>  Output only the values at the given path, one per line, e.g. \".user.id\",\n");
+    fprintf(stderr, "               \"[0]\" or \".events[*].id\" (may be given more than once)\n");
+    fprintf(stderr, "    -I <index>  Index of the records of the input file, built if missing or stale\n");
+    fprintf(stderr, "               (without -r, only builds the index)\n");
+    fprintf(stderr, "    -r <range>  Convert only the given records of the input file, e.g. \"5\", \"10:20\" or\n");
+    fprintf(stderr, "                \"100:\", counting from 0 (implies -c)\n");
+    fprintf(stderr, "    -j <threads>  Convert continuous mode objects or a top-level array on multiple threads\n");
+    fprintf(stderr, "    -a <block-kb>  Read and write on I/O threads in blocks of the given size in KiB\n");
+    fprintf(stderr, "    -u  Unbuffered, output each continuous mode object as soon as it is converted\n");
+    fprintf(stderr, "    -V  Validate the input without converting it, reporting the offset of the first error\n");
+    fprintf(stderr, "    -s  Print conversion statistics to stderr\n");
+    fprintf(stderr, "    -S  Print conversion statistics to stderr as a line of JSON\n");
+    fprintf(stderr, "    -H  Print histograms of record latency and size to stderr at exit and on SIGUSR1\n");
+    fprintf(stderr, "    -L  Batch mode, read input filenames from stdin, one per line\n");
+    fprintf(stderr, "    -O <template>  Batch mode output filenames, where %%s is the input without\n");
+    fprintf(stderr, "                   its extension and %%n is the same without its directory\n");
+    fprintf(stderr, "                   (default \"%%s.json\")\n");
     fprintf(stderr, "    -h  Print this help\n");
     fprintf(stderr, "    -v  Print version information\n");
     fprintf(stderr, "For viewing MessagePack, you probably want -d or -di <filename>.\n");
@@ -395,17 +1590,23 @@ static void version(const char* command) {
     fprintf(stderr, "%s version %s -- %s\n", command, VERSION, "https://github.com/ludocode/msgpack-tools");
     fprintf(stderr, "MPack version %s -- %s\n", MPACK_VERSION_STRING, "https://github.com/ludocode/mpack");
     fprintf(stderr, "RapidJSON version %s -- %s\n", RAPIDJSON_VERSION_STRING, "http://rapidjson.org/");
-    fprintf(stderr, "libb64 version %s -- %s\n", LIBB64_VERSION, "http://libb64.sourceforge.net/");
 }
 
+// The microbenchmarks (tools/microbench.cpp) and the library
+// (src/msgpacktools.cpp) include this file to call its conversion routines
+// directly.
+#ifndef MSGPACK2JSON_NO_MAIN
 int main(int argc, char** argv) {
     options_t options;
     memset(&options, 0, sizeof(options));
     options.command = argv[0];
+    select_t selection;
+    memset(&selection, 0, sizeof(selection));
+    const char* message;
 
     opterr = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "i:o:x:dpbBcChv?")) != -1) {
+    while ((opt = getopt(argc, argv, "i:o:x:e:I:r:j:a:O:dpbBcCuVsSHLhv?")) != -1) {
         switch (opt) {
             case 'i':
                 options.in_filename = optarg;
@@ -456,6 +1657,51 @@ int main(int argc, char** argv) {
                 options.continuous_mode = continuous_delimited;
                 options.continuous_mode_delimiter = optarg[0];
                 break;
+            case 'e':
+                if (!select_add(&selection, optarg, &message)) {
+                    fprintf(stderr, "%s: invalid path \"%s\": %s\n", options.command, optarg, message);
+                    return EXIT_FAILURE;
+                }
+                options.select = &selection;
+                break;
+            case 'I':
+                options.index_filename = optarg;
+                break;
+            case 'r':
+                if (!index_parse_range(optarg, &options.range)) {
+                    fprintf(stderr, "%s: -r requires a record or range of records such as 5, 10:20 or 100:, not \"%s\"\n",
+                            options.command, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.has_range = true;
+                break;
+            case 'j':
+                parse_threads(&options);
+                break;
+            case 'u':
+                options.unbuffered = true;
+                break;
+            case 'V':
+                options.validate = true;
+                break;
+            case 'a':
+                parse_block_size(&options);
+                break;
+            case 's':
+                options.stats = stats_text;
+                break;
+            case 'S':
+                options.stats = stats_json;
+                break;
+            case 'H':
+                options.histogram = true;
+                break;
+            case 'L':
+                options.file_list = true;
+                break;
+            case 'O':
+                options.output_template = optarg;
+                break;
             case 'h':
                 usage(options.command);
                 return EXIT_SUCCESS;
@@ -468,7 +1714,8 @@ int main(int argc, char** argv) {
                     usage(options.command);
                     return EXIT_SUCCESS;
                 }
-                if (optopt == 'i' || optopt == 'o')
+                if (optopt == 'i' || optopt == 'o' || optopt == 'x' || optopt == 'e' || optopt == 'I' ||
+                        optopt == 'r' || optopt == 'j' || optopt == 'a' || optopt == 'O')
                     fprintf(stderr, "%s: option '%c' requires an argument\n", options.command, optopt);
                 else
                     fprintf(stderr, "%s: invalid option -- '%c'\n", options.command, optopt);
@@ -477,11 +1724,65 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (optind < argc) {
-        fprintf(stderr, "%s: not an option -- \"%s\"\n", options.command, argv[optind]);
+    // Selected values are output one per line, so they can't be delimited.
+    if (options.select && options.continuous_mode == continuous_delimited) {
+        fprintf(stderr, "%s: -C and -x cannot be used with -e\n", options.command);
         usage(options.command);
         return EXIT_FAILURE;
     }
 
-    return convert(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (options.validate && options.out_filename) {
+        fprintf(stderr, "%s: -V does not write output, so -o cannot be used with it\n", options.command);
+        usage(options.command);
+        return EXIT_FAILURE;
+    }
+
+    // A range of records is taken from a continuous stream.
+    if (options.has_range && options.continuous_mode == continuous_off)
+        options.continuous_mode = continuous_undelimited;
+
+    // Input files as arguments or -L switch to batch mode
+    if (optind == argc && !options.file_list) {
+        if (options.output_template) {
+            fprintf(stderr, "%s: -O requires input files or -L\n", options.command);
+            usage(options.command);
+            return EXIT_FAILURE;
+        }
+        bool ok = convert(&options);
+        select_destroy(&selection);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.in_filename || options.out_filename || options.index_filename || options.has_range) {
+        fprintf(stderr, "%s: -i, -o, -I and -r cannot be used with input files or -L\n", options.command);
+        usage(options.command);
+        return EXIT_FAILURE;
+    }
+    if (!options.output_template)
+        options.output_template = "%s.json";
+    if (!batch_check_template(options.output_template)) {
+        fprintf(stderr, "%s: -O requires a template containing %%s or %%n, not \"%s\"\n",
+                options.command, options.output_template);
+        return EXIT_FAILURE;
+    }
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    bool ok = true;
+    for (int i = optind; ok && i < argc; ++i)
+        ok = batch_add(&batch, argv[i], strlen(argv[i]));
+    if (!ok)
+        fprintf(stderr, "%s: allocation failure\n", options.command);
+    if (ok && options.file_list && !batch_read_list(&batch, stdin)) {
+        fprintf(stderr, "%s: error reading file list\n", options.command);
+        ok = false;
+    }
+    if (ok)
+        ok = batch_make_outputs(&batch, options.command, options.output_template, !options.validate);
+    if (ok)
+        ok = convert_batch(&options, &batch);
+    batch_destroy(&batch);
+    select_destroy(&selection);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+#endif
@@ -0,0 +1,221 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// The library is built from the tools' own sources: we include each tool with
+// its main() compiled out, in a namespace of its own since both tools use the
+// same names for their options and routines. Everything they share (mpack,
+// rapidjson and our headers) is included first so that it stays global.
+//
+// Only the functions declared in msgpacktools.h are exported; the library is
+// compiled with hidden visibility by default.
+
+#define RAPIDJSON_ASSERT(x) ((void)(x))
+
+#include "common.h"
+#include "base64.h"
+#include "batch.h"
+#include "escape.h"
+#include "index.h"
+#include "number.h"
+#include "parallel.h"
+#include "select.h"
+#include "stats.h"
+#include "utf8.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+namespace msgpack2json_tool {
+    #define MSGPACK2JSON_NO_MAIN 1
+    #include "msgpack2json.cpp"
+}
+
+namespace json2msgpack_tool {
+    #define JSON2MSGPACK_NO_MAIN 1
+    #include "json2msgpack.cpp"
+}
+
+#include "msgpacktools.h"
+
+static void msgpack2json_options(const msgpack2json_options_t* in, msgpack2json_tool::options_t* options) {
+    memset(options, 0, sizeof(*options));
+    options->command = "msgpack2json";
+    if (!in)
+        return;
+    options->debug = in->debug;
+    options->pretty = in->pretty;
+    options->base64 = in->base64;
+    options->base64_prefix = in->base64_prefix;
+    if (in->continuous) {
+        options->continuous_mode = in->delimiter ? msgpack2json_tool::continuous_delimited :
+                msgpack2json_tool::continuous_undelimited;
+        options->continuous_mode_delimiter = in->delimiter;
+    }
+}
+
+// Converts MessagePack to JSON in the stream. The scratch buffer is used for
+// base64 and can be reused from one conversion to the next.
+template <class StreamType>
+static bool msgpack2json_run(const msgpack2json_options_t* in, const char* data, size_t size, StreamType& stream,
+        buffer_t* scratch)
+{
+    msgpack2json_tool::options_t options;
+    msgpack2json_options(in, &options);
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, data, size);
+    bool ok = msgpack2json_tool::convert_reader(&reader, stream, &options, scratch, NULL, true);
+
+    mpack_error_t error = mpack_reader_destroy(&reader);
+    if (!ok)
+        fprintf(stderr, "%s: parse error: %s (%i)\n", options.command, mpack_error_to_string(error), (int)error);
+    return ok;
+}
+
+bool msgpack2json_convert(const msgpack2json_options_t* options,
+        const char* data, size_t size, char** json, size_t* json_size)
+{
+    buffer_t output = {NULL, 0, 0};
+    buffer_t scratch = {NULL, 0, 0};
+    BufferStream stream(&output);
+    bool ok = msgpack2json_run(options, data, size, stream, &scratch);
+    buffer_destroy(&scratch);
+    if (ok && stream.error) {
+        fprintf(stderr, "msgpack2json: allocation failure\n");
+        ok = false;
+    }
+    if (!ok) {
+        buffer_destroy(&output);
+        return false;
+    }
+    *json = output.data;
+    *json_size = output.size;
+    return true;
+}
+
+bool msgpack2json_convert_stream(const msgpack2json_options_t* options,
+        const char* data, size_t size, msgpacktools_write_t write, void* context)
+{
+    char* buffer = (char*)malloc(BUFFER_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "msgpack2json: allocation failure\n");
+        return false;
+    }
+    buffer_t scratch = {NULL, 0, 0};
+    FileStream stream(write, context, buffer, BUFFER_SIZE);
+    bool ok = msgpack2json_run(options, data, size, stream, &scratch);
+    buffer_destroy(&scratch);
+    free(buffer);
+    if (ok && stream.error) {
+        fprintf(stderr, "msgpack2json: error writing output\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// Output of a streaming json2msgpack conversion
+typedef struct json2msgpack_output_t {
+    msgpacktools_write_t write;
+    void* context;
+} json2msgpack_output_t;
+
+static void json2msgpack_flush(mpack_writer_t* writer, const char* data, size_t count) {
+    json2msgpack_output_t* output = (json2msgpack_output_t*)writer->context;
+    if (!output->write(output->context, data, count))
+        mpack_writer_flag_error(writer, mpack_error_io);
+}
+
+// Converts the JSON with an already initialized writer, which is destroyed.
+// The scratch buffer is used for base64 and can be reused.
+static bool json2msgpack_run(const json2msgpack_options_t* in, const char* data, size_t size, mpack_writer_t* writer,
+        buffer_t* scratch)
+{
+    json2msgpack_tool::options_t options;
+    memset(&options, 0, sizeof(options));
+    options.command = "json2msgpack";
+    if (in) {
+        options.lax = in->lax;
+        options.use_float = in->use_float;
+        options.base64_prefix = in->base64_prefix;
+        options.base64_min_bytes = in->base64_min_bytes;
+    }
+
+    // rapidjson treats a null byte as the end of the input (see Fill() in
+    // json2msgpack.cpp.)
+    bool ok = memchr(data, '\0', size) == NULL;
+    if (!ok) {
+        fprintf(stderr, "%s: JSON cannot contain null bytes\n", options.command);
+    } else {
+        json2msgpack_tool::ChunkedStream stream;
+        json2msgpack_tool::open_memory_stream(&options, &stream, data, size, 0);
+        ok = json2msgpack_tool::convert_values(&options, stream, writer, scratch, NULL);
+    }
+
+    // The handler has already reported the error if conversion failed. We
+    // flag it on the writer so that it doesn't complain about unclosed
+    // containers.
+    if (!ok && mpack_writer_error(writer) == mpack_ok)
+        mpack_writer_flag_error(writer, mpack_error_data);
+    mpack_error_t error = mpack_writer_destroy(writer);
+    if (error != mpack_ok && error != mpack_error_data) {
+        fprintf(stderr, "%s: error writing MessagePack: %s (%i)\n", options.command,
+                mpack_error_to_string(error), (int)error);
+        ok = false;
+    }
+    return ok;
+}
+
+bool json2msgpack_convert(const json2msgpack_options_t* options,
+        const char* data, size_t size, char** msgpack, size_t* msgpack_size)
+{
+    // The growable writer only sets the output if it is destroyed without
+    // error.
+    mpack_writer_t writer;
+    mpack_writer_init_growable(&writer, msgpack, msgpack_size);
+    buffer_t scratch = {NULL, 0, 0};
+    bool ok = json2msgpack_run(options, data, size, &writer, &scratch);
+    buffer_destroy(&scratch);
+    return ok;
+}
+
+bool json2msgpack_convert_stream(const json2msgpack_options_t* options,
+        const char* data, size_t size, msgpacktools_write_t write, void* context)
+{
+    char* buffer = (char*)malloc(BUFFER_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "json2msgpack: allocation failure\n");
+        return false;
+    }
+    json2msgpack_output_t output = {write, context};
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, BUFFER_SIZE);
+    mpack_writer_set_context(&writer, &output);
+    mpack_writer_set_flush(&writer, json2msgpack_flush);
+    buffer_t scratch = {NULL, 0, 0};
+    bool ok = json2msgpack_run(options, data, size, &writer, &scratch);
+    buffer_destroy(&scratch);
+    free(buffer);
+    return ok;
+}
@@ -0,0 +1,95 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACKTOOLS_H
+#define MSGPACKTOOLS_H 1
+
+// libmsgpacktools: the conversions of msgpack2json and json2msgpack as a
+// library, for converting in-process rather than running the tools.
+//
+// Each conversion takes its whole input in memory and either returns the
+// output in a buffer allocated with malloc(), which the caller must free(),
+// or passes the output in chunks to a callback as it is produced. The
+// functions are thread-safe; each call has its own state.
+//
+// Conversions return false on failure. Errors are reported on stderr, as
+// the tools would report them.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MSGPACKTOOLS_API __attribute__((visibility("default")))
+
+// Options for converting MessagePack to JSON, corresponding to those of
+// msgpack2json. A zeroed struct gives the defaults.
+typedef struct msgpack2json_options_t {
+    bool debug;         // -d, output pseudo-JSON instead of failing on bin and ext
+    bool pretty;        // -p
+    bool base64;        // -b or -B, convert bin to base64 strings
+    bool base64_prefix; // -b, with a "base64:" prefix
+    bool continuous;    // -c, convert any number of top-level objects
+    char delimiter;     // -C or -x, delimiter in continuous mode, or '\0' for none
+} msgpack2json_options_t;
+
+// Options for converting JSON to MessagePack, corresponding to those of
+// json2msgpack. A zeroed struct gives the defaults.
+typedef struct json2msgpack_options_t {
+    bool lax;                // -l
+    bool use_float;          // -f
+    bool base64_prefix;      // -b
+    size_t base64_min_bytes; // -B, or 0 for no detection
+} json2msgpack_options_t;
+
+// Receives output from a streaming conversion. Returns false to abort the
+// conversion.
+typedef bool (*msgpacktools_write_t)(void* context, const char* data, size_t size);
+
+// Converts MessagePack to JSON. On success, *json is set to a buffer of
+// *json_size bytes (not NUL-terminated.) options may be NULL for defaults.
+MSGPACKTOOLS_API bool msgpack2json_convert(const msgpack2json_options_t* options,
+        const char* data, size_t size, char** json, size_t* json_size);
+
+// Converts MessagePack to JSON, passing the output to write in chunks.
+MSGPACKTOOLS_API bool msgpack2json_convert_stream(const msgpack2json_options_t* options,
+        const char* data, size_t size, msgpacktools_write_t write, void* context);
+
+// Converts JSON to MessagePack. On success, *msgpack is set to a buffer of
+// *msgpack_size bytes. All top-level values in the input are converted.
+MSGPACKTOOLS_API bool json2msgpack_convert(const json2msgpack_options_t* options,
+        const char* data, size_t size, char** msgpack, size_t* msgpack_size);
+
+// Converts JSON to MessagePack, passing the output to write in chunks.
+MSGPACKTOOLS_API bool json2msgpack_convert_stream(const json2msgpack_options_t* options,
+        const char* data, size_t size, msgpacktools_write_t write, void* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
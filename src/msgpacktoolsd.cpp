@@ -0,0 +1,745 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// msgpacktoolsd, a conversion server on a Unix domain socket. It saves the
+// cost of starting a process for each conversion; clients send the input of
+// each conversion along with the tool and options to convert it with, and
+// receive the output.
+//
+// A client sends any number of requests on a connection and receives a
+// response to each, in order. A request is:
+//
+//     u32 header length, header, u32 data length, data
+//
+// where lengths are big-endian and the header is the command line of the
+// conversion: the tool (msgpack2json or json2msgpack) followed by its options,
+// separated by spaces, e.g. "msgpack2json -pB" or "json2msgpack -b -B 22". The
+// response is:
+//
+//     u8 status, u32 length, body
+//
+// where status is 0 and the body is the output on success, or status is 1
+// and the body is an error message.
+//
+// The main thread runs an event loop over all connections with poll(). Each
+// complete request is handed to a pool of worker threads, which convert it
+// into the connection's output buffer and wake the event loop to send it. A
+// connection has at most one request being converted at a time, so responses
+// stay in order, and its buffers are kept for its next request. Each worker
+// keeps its own scratch and writer buffers.
+//
+// We stop reading from a connection while it has a whole request waiting or
+// a response to send, so a client that sends without reading the responses
+// can't make us buffer more than one request. Clients that pipeline requests
+// must therefore read responses as they send.
+//
+// We include the library source so that the workers can convert with their
+// own reusable buffers.
+
+#include "msgpacktools.cpp"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_MAX_HEADER 4096
+#define SERVE_MAX_DATA (1024u * 1024u * 1024u)
+#define SERVE_READ_SIZE 65536
+
+// The most we buffer from a connection: one request of the largest size
+#define SERVE_MAX_REQUEST (8 + (size_t)SERVE_MAX_HEADER + SERVE_MAX_DATA)
+
+typedef struct connection_t {
+    int fd;
+    buffer_t in;         // received bytes; the first request starts at the beginning
+    buffer_t out;        // responses to send
+    size_t out_sent;
+    size_t request_size; // size of the request being converted
+    bool busy;           // a worker is converting a request
+    bool eof;            // the client has shut down its side, or sent garbage
+    bool failed;         // the connection is to be closed
+    struct connection_t* next; // in the work queue or the done list
+} connection_t;
+
+typedef struct server_t {
+    const char* command;
+    int listen_fd;
+    int wake[2]; // a pipe that wakes the event loop
+
+    // Work queue and done list, protected by lock. Workers take connections
+    // with a request to convert from the queue, and put them on the done
+    // list when the response is ready.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    connection_t* queue_head;
+    connection_t* queue_tail;
+    connection_t* done;
+    bool stopping;
+
+    connection_t** connections;
+    size_t count;
+    size_t capacity;
+} server_t;
+
+// SIGINT and SIGTERM stop the server cleanly, so that the socket is removed.
+static volatile sig_atomic_t serve_stop = 0;
+static int serve_wake_fd = -1;
+
+static void serve_signal_handler(int signal) {
+    (void)signal;
+    serve_stop = 1;
+    ssize_t ret = write(serve_wake_fd, "", 1);
+    (void)ret;
+}
+
+static uint32_t read_u32(const char* p) {
+    const uint8_t* u = (const uint8_t*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+static void write_u32(char* p, uint32_t value) {
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+static bool respond(buffer_t* out, uint8_t status, const char* body, size_t size) {
+    char header[5];
+    header[0] = (char)status;
+    write_u32(header + 1, (uint32_t)size);
+    return buffer_append(out, header, sizeof(header)) && buffer_append(out, body, size);
+}
+
+static bool respond_error(buffer_t* out, const char* message) {
+    return respond(out, 1, message, strlen(message));
+}
+
+// The options of a request, parsed from its header
+typedef struct request_t {
+    bool to_json;
+    msgpack2json_options_t msgpack2json;
+    json2msgpack_options_t json2msgpack;
+} request_t;
+
+// Parses the header of a request into its options. The header is modified.
+// Only the options that affect the conversion are accepted, with the same
+// meaning as for the tools. On error, message is set.
+static bool parse_header(char* header, request_t* request, const char** message) {
+    memset(request, 0, sizeof(*request));
+    char* save = NULL;
+    char* tool = strtok_r(header, " ", &save);
+    if (tool && strcmp(tool, "msgpack2json") == 0) {
+        request->to_json = true;
+    } else if (!tool || strcmp(tool, "json2msgpack") != 0) {
+        *message = "request must start with msgpack2json or json2msgpack";
+        return false;
+    }
+
+    char* arg;
+    while ((arg = strtok_r(NULL, " ", &save)) != NULL) {
+        if (arg[0] != '-' || arg[1] == '\0') {
+            *message = "not an option";
+            return false;
+        }
+        for (const char* p = arg + 1; *p; ++p) {
+            // options that take an argument take the rest of this word or
+            // the next one
+            const char* value = NULL;
+            if (*p == 'x' || (*p == 'B' && !request->to_json)) {
+                value = p[1] ? p + 1 : strtok_r(NULL, " ", &save);
+                if (!value) {
+                    *message = "option requires an argument";
+                    return false;
+                }
+            }
+
+            if (request->to_json) {
+                msgpack2json_options_t* options = &request->msgpack2json;
+                switch (*p) {
+                    case 'd': options->debug = true; options->pretty = true; break;
+                    case 'p': options->pretty = true; break;
+                    case 'b': options->base64 = true; options->base64_prefix = true; break;
+                    case 'B': options->base64 = true; options->base64_prefix = false; break;
+                    case 'c': options->continuous = true; options->delimiter = '\0'; break;
+                    case 'C': options->continuous = true; options->delimiter = ','; break;
+                    case 'x':
+                        if (strlen(value) > 1) {
+                            *message = "You cannot have a multicharacter delimiter.";
+                            return false;
+                        }
+                        options->continuous = true;
+                        options->delimiter = value[0];
+                        break;
+                    default:
+                        *message = "invalid option for msgpack2json";
+                        return false;
+                }
+            } else {
+                json2msgpack_options_t* options = &request->json2msgpack;
+                switch (*p) {
+                    case 'l': options->lax = true; break;
+                    case 'f': options->use_float = true; break;
+                    case 'b': options->base64_prefix = true; break;
+                    case 'B': {
+                        char* end;
+                        errno = 0;
+                        long long min = strtoll(value, &end, 10);
+                        if (errno != 0 || *end != '\0' || min <= 0) {
+                            *message = "-B requires a positive integer";
+                            return false;
+                        }
+                        options->base64_min_bytes = (size_t)min;
+                        break;
+                    }
+                    default:
+                        *message = "invalid option for json2msgpack";
+                        return false;
+                }
+            }
+
+            if (value)
+                break;
+        }
+    }
+    return true;
+}
+
+static void serve_flush(mpack_writer_t* writer, const char* data, size_t count) {
+    if (!buffer_append((buffer_t*)writer->context, data, count))
+        mpack_writer_flag_error(writer, mpack_error_memory);
+}
+
+// Converts the request at the start of the connection's input, appending the
+// response to its output. Called on a worker thread.
+static void convert_request(connection_t* connection, buffer_t* scratch, char* writer_buffer) {
+    const char* p = connection->in.data;
+    uint32_t header_size = read_u32(p);
+    char header[SERVE_MAX_HEADER + 1];
+    memcpy(header, p + 4, header_size);
+    header[header_size] = '\0';
+    uint32_t size = read_u32(p + 4 + header_size);
+    const char* data = p + 8 + header_size;
+
+    buffer_t* out = &connection->out;
+    request_t request;
+    const char* message;
+    if (!parse_header(header, &request, &message)) {
+        if (!respond_error(out, message))
+            connection->failed = true;
+        return;
+    }
+
+    // The output is written after space for the response header, which is
+    // filled in once its size is known.
+    size_t start = out->size;
+    if (!buffer_append(out, "\0\0\0\0\0", 5)) {
+        connection->failed = true;
+        return;
+    }
+    bool ok;
+    if (request.to_json) {
+        BufferStream stream(out);
+        ok = msgpack2json_run(&request.msgpack2json, data, size, stream, scratch) && !stream.error;
+    } else {
+        mpack_writer_t writer;
+        mpack_writer_init(&writer, writer_buffer, BUFFER_SIZE);
+        mpack_writer_set_context(&writer, out);
+        mpack_writer_set_flush(&writer, serve_flush);
+        ok = json2msgpack_run(&request.json2msgpack, data, size, &writer, scratch);
+    }
+
+    size_t body_size = out->size - start - 5;
+    if (ok && body_size <= UINT32_MAX) {
+        write_u32(out->data + start + 1, (uint32_t)body_size);
+        return;
+    }
+    out->size = start;
+    if (!respond_error(out, request.to_json ? "msgpack2json: conversion failed" : "json2msgpack: conversion failed"))
+        connection->failed = true;
+}
+
+static void* serve_worker(void* arg) {
+    server_t* server = (server_t*)arg;
+    buffer_t scratch = {NULL, 0, 0};
+    char* writer_buffer = (char*)malloc(BUFFER_SIZE);
+
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->queue_head && !server->stopping)
+            pthread_cond_wait(&server->cond, &server->lock);
+        connection_t* connection = server->queue_head;
+        if (!connection) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        server->queue_head = connection->next;
+        if (!server->queue_head)
+            server->queue_tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        if (writer_buffer)
+            convert_request(connection, &scratch, writer_buffer);
+        else
+            connection->failed = true;
+
+        pthread_mutex_lock(&server->lock);
+        connection->next = server->done;
+        server->done = connection;
+        pthread_mutex_unlock(&server->lock);
+        ssize_t ret = write(server->wake[1], "", 1);
+        (void)ret; // if the pipe is full, the event loop is already awake
+    }
+
+    free(writer_buffer);
+    buffer_destroy(&scratch);
+    return NULL;
+}
+
+// Returns true if the input holds a whole request of an acceptable size.
+static bool has_request(const buffer_t* in) {
+    if (in->size < 4)
+        return false;
+    uint32_t header_size = read_u32(in->data);
+    if (header_size > SERVE_MAX_HEADER || in->size < 8 + (size_t)header_size)
+        return false;
+    uint32_t size = read_u32(in->data + 4 + header_size);
+    return size <= SERVE_MAX_DATA && in->size >= 8 + (size_t)header_size + size;
+}
+
+// Returns true if we should read more from the connection. A worker owns its
+// buffers while it is busy, and we don't read ahead of a request that is
+// waiting or a response that hasn't been sent.
+static bool wants_input(const connection_t* connection) {
+    return !connection->busy && !connection->eof && connection->out.size == 0 && !has_request(&connection->in);
+}
+
+// Hands the next request on the connection to the workers if it has been
+// received entirely and the previous response has been sent.
+static void dispatch(server_t* server, connection_t* connection) {
+    if (connection->busy || connection->failed || connection->out.size > 0)
+        return;
+
+    buffer_t* in = &connection->in;
+    if (in->size < 4)
+        return;
+    uint32_t header_size = read_u32(in->data);
+    uint32_t size = 0;
+    if (header_size <= SERVE_MAX_HEADER && in->size >= 8 + (size_t)header_size)
+        size = read_u32(in->data + 4 + header_size);
+    if (header_size > SERVE_MAX_HEADER || size > SERVE_MAX_DATA) {
+        // We can't find the next request, so this is the last response.
+        if (!respond_error(&connection->out, "request too large"))
+            connection->failed = true;
+        in->size = 0;
+        connection->eof = true;
+        return;
+    }
+    if (in->size < 8 + (size_t)header_size + size)
+        return;
+
+    connection->request_size = 8 + (size_t)header_size + size;
+    connection->busy = true;
+    connection->next = NULL;
+    pthread_mutex_lock(&server->lock);
+    if (server->queue_tail)
+        server->queue_tail->next = connection;
+    else
+        server->queue_head = connection;
+    server->queue_tail = connection;
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Sends as much of the output as the socket takes.
+static void send_output(connection_t* connection) {
+    buffer_t* out = &connection->out;
+    while (connection->out_sent < out->size) {
+        ssize_t n = send(connection->fd, out->data + connection->out_sent, out->size - connection->out_sent, 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                connection->failed = true;
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        connection->out_sent += (size_t)n;
+    }
+    out->size = 0;
+    connection->out_sent = 0;
+}
+
+// Reads until the socket is drained or a whole request has been received.
+// Reads are limited to the largest request; anything larger is rejected by
+// dispatch().
+static void receive_input(connection_t* connection) {
+    buffer_t* in = &connection->in;
+    while (in->size < SERVE_MAX_REQUEST && !has_request(in)) {
+        if (!buffer_reserve(in, SERVE_READ_SIZE)) {
+            connection->failed = true;
+            return;
+        }
+        size_t space = in->capacity - in->size;
+        if (space > SERVE_MAX_REQUEST - in->size)
+            space = SERVE_MAX_REQUEST - in->size;
+        ssize_t n = recv(connection->fd, in->data + in->size, space, 0);
+        if (n == 0) {
+            connection->eof = true;
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                connection->failed = true;
+            return;
+        }
+        in->size += (size_t)n;
+    }
+}
+
+// Handles the connections whose conversions the workers have finished.
+static void collect_done(server_t* server) {
+    char drain[256];
+    while (read(server->wake[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&server->lock);
+    connection_t* connection = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (connection) {
+        connection_t* next = connection->next;
+        buffer_t* in = &connection->in;
+        memmove(in->data, in->data + connection->request_size, in->size - connection->request_size);
+        in->size -= connection->request_size;
+        connection->busy = false;
+        send_output(connection);
+        dispatch(server, connection);
+        connection = next;
+    }
+}
+
+static void accept_connections(server_t* server) {
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "%s: accept failed: %s\n", server->command, strerror(errno));
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        connection_t* connection = (connection_t*)calloc(1, sizeof(connection_t));
+        if (connection && server->count == server->capacity) {
+            size_t capacity = server->capacity ? server->capacity * 2 : 64;
+            connection_t** connections = (connection_t**)realloc(server->connections,
+                    capacity * sizeof(connection_t*));
+            if (connections) {
+                server->connections = connections;
+                server->capacity = capacity;
+            }
+        }
+        if (!connection || server->count == server->capacity) {
+            fprintf(stderr, "%s: allocation failure\n", server->command);
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        server->connections[server->count++] = connection;
+    }
+}
+
+static void close_connection(connection_t* connection) {
+    close(connection->fd);
+    buffer_destroy(&connection->in);
+    buffer_destroy(&connection->out);
+    free(connection);
+}
+
+// Closes connections that have failed, or that the client has shut down
+// and have nothing left to convert or send.
+static void remove_connections(server_t* server) {
+    size_t kept = 0;
+    for (size_t i = 0; i < server->count; ++i) {
+        connection_t* connection = server->connections[i];
+        bool finished = connection->eof && !connection->busy && connection->out.size == 0;
+        if (!connection->busy && (connection->failed || finished))
+            close_connection(connection);
+        else
+            server->connections[kept++] = connection;
+    }
+    server->count = kept;
+}
+
+static bool event_loop(server_t* server) {
+    struct pollfd* fds = NULL;
+    size_t fds_capacity = 0;
+
+    while (!serve_stop) {
+        if (fds_capacity < server->count + 2) {
+            fds_capacity = server->count + 2 + 64;
+            struct pollfd* grown = (struct pollfd*)realloc(fds, fds_capacity * sizeof(struct pollfd));
+            if (!grown) {
+                fprintf(stderr, "%s: allocation failure\n", server->command);
+                free(fds);
+                return false;
+            }
+            fds = grown;
+        }
+
+        fds[0].fd = server->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server->wake[0];
+        fds[1].events = POLLIN;
+        // A worker owns the buffers of a connection while it is busy, so we
+        // don't poll it until the worker is done.
+        for (size_t i = 0; i < server->count; ++i) {
+            connection_t* connection = server->connections[i];
+            fds[i + 2].fd = connection->busy ? -1 : connection->fd;
+            fds[i + 2].events = 0;
+            if (connection->busy)
+                continue;
+            if (wants_input(connection))
+                fds[i + 2].events |= POLLIN;
+            if (connection->out.size > 0)
+                fds[i + 2].events |= POLLOUT;
+        }
+
+        size_t count = server->count;
+        if (poll(fds, count + 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: poll failed: %s\n", server->command, strerror(errno));
+            free(fds);
+            return false;
+        }
+
+        // Connections are only added and removed below, after we're done
+        // with the results for the ones we polled.
+        for (size_t i = 0; i < count; ++i) {
+            connection_t* connection = server->connections[i];
+            short revents = fds[i + 2].revents;
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && wants_input(connection)) {
+                receive_input(connection);
+                dispatch(server, connection);
+            }
+            if ((revents & (POLLOUT | POLLHUP | POLLERR)) && !connection->busy && connection->out.size > 0) {
+                send_output(connection);
+                dispatch(server, connection);
+            }
+        }
+        if (fds[1].revents & POLLIN)
+            collect_done(server);
+        if (fds[0].revents & POLLIN)
+            accept_connections(server);
+        remove_connections(server);
+    }
+
+    free(fds);
+    return true;
+}
+
+static int listen_socket(const char* command, const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path is too long: \"%s\"\n", command, path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by a server that was killed is replaced, but not
+    // one that a server is still listening on. We don't remove anything that
+    // isn't a socket.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe == -1) {
+            fprintf(stderr, "%s: could not create socket: %s\n", command, strerror(errno));
+            return -1;
+        }
+        bool listening = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+        bool stale = !listening && errno == ECONNREFUSED;
+        close(probe);
+        if (listening) {
+            fprintf(stderr, "%s: a server is already listening on \"%s\"\n", command, path);
+            return -1;
+        }
+        if (stale)
+            unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "%s: could not listen on \"%s\": %s\n", command, path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static bool serve(const char* command, const char* path, size_t threads) {
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.command = command;
+
+    if (pipe(server.wake) != 0) {
+        fprintf(stderr, "%s: could not create pipe: %s\n", command, strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < 2; ++i)
+        fcntl(server.wake[i], F_SETFL, fcntl(server.wake[i], F_GETFL) | O_NONBLOCK);
+
+    server.listen_fd = listen_socket(command, path);
+    if (server.listen_fd == -1) {
+        close(server.wake[0]);
+        close(server.wake[1]);
+        return false;
+    }
+
+    // Signals interrupt poll() (there is no SA_RESTART) and also wake it
+    // through the pipe in case they arrive just before it.
+    serve_wake_fd = server.wake[1];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    pthread_t* workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    size_t started = 0;
+    while (workers && started < threads && pthread_create(&workers[started], NULL, serve_worker, &server) == 0)
+        ++started;
+
+    bool ok = started > 0;
+    if (!ok)
+        fprintf(stderr, "%s: could not start worker threads\n", command);
+    else
+        ok = event_loop(&server);
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    // The workers have finished whatever they had, so every connection can
+    // be closed.
+    for (size_t i = 0; i < server.count; ++i)
+        close_connection(server.connections[i]);
+    free(server.connections);
+    close(server.listen_fd);
+    unlink(path);
+    close(server.wake[0]);
+    close(server.wake[1]);
+    pthread_cond_destroy(&server.cond);
+    pthread_mutex_destroy(&server.lock);
+    return ok;
+}
+
+static void usage(const char* command) {
+    fprintf(stderr, "Usage: %s [-j <threads>] <socket>\n", command);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    <socket>  Path of the Unix domain socket to listen on\n");
+    fprintf(stderr, "    -j <threads>  Number of conversion threads (default one per CPU)\n");
+    fprintf(stderr, "    -h  Print this help\n");
+    fprintf(stderr, "    -v  Print version information\n");
+}
+
+static void version(const char* command) {
+    fprintf(stderr, "%s version %s -- %s\n", command, VERSION, "https://github.com/ludocode/msgpack-tools");
+    fprintf(stderr, "MPack version %s -- %s\n", MPACK_VERSION_STRING, "https://github.com/ludocode/mpack");
+    fprintf(stderr, "RapidJSON version %s -- %s\n", RAPIDJSON_VERSION_STRING, "http://rapidjson.org/");
+}
+
+int main(int argc, char** argv) {
+    const char* command = argv[0];
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = online > 0 ? (size_t)online : 1;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+
+    opterr = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:hv?")) != -1) {
+        switch (opt) {
+            case 'j': {
+                char* end;
+                errno = 0;
+                long value = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || value <= 0 || value > PARALLEL_MAX_THREADS) {
+                    fprintf(stderr, "%s: -j requires a thread count between 1 and %i, not \"%s\"\n",
+                            command, PARALLEL_MAX_THREADS, optarg);
+                    return EXIT_FAILURE;
+                }
+                threads = (size_t)value;
+                break;
+            }
+            case 'h':
+                usage(command);
+                return EXIT_SUCCESS;
+            case 'v':
+                version(command);
+                return EXIT_SUCCESS;
+            default: /* ? */
+                if (optopt == 0) {
+                    // we allow both -h and -? as help
+                    usage(command);
+                    return EXIT_SUCCESS;
+                }
+                if (optopt == 'j')
+                    fprintf(stderr, "%s: -%c requires an argument\n", command, optopt);
+                else
+                    fprintf(stderr, "%s: invalid option -- '%c'\n", command, optopt);
+                usage(command);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s: a socket path is required\n", command);
+        usage(command);
+        return EXIT_FAILURE;
+    }
+
+    return serve(command, argv[optind], threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,325 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSGPACK_TOOLS_PARALLEL_H
+#define MSGPACK_TOOLS_PARALLEL_H 1
+
+// A pool of worker threads that converts jobs concurrently and writes their
+// output in the order they were submitted.
+//
+// The submitting thread splits the input into jobs, each covering a run of
+// whole top-level elements. Workers convert jobs into their own output
+// buffers, and a writer thread writes out the buffers in order. The number
+// of jobs in flight is bounded so that memory usage stays bounded no matter
+// how far the submitter gets ahead of the writer.
+
+#include <pthread.h>
+
+#include "buffer.h"
+#include "stats.h"
+
+// The amount of input we try to put in each job. This is large enough that
+// synchronization overhead is negligible.
+#define PARALLEL_JOB_SIZE (256 * 1024)
+
+// The number of jobs that can be in flight per worker thread.
+#define PARALLEL_JOBS_PER_THREAD 4
+
+// The maximum number of threads that can be requested with -j.
+#define PARALLEL_MAX_THREADS 1024
+
+typedef struct parallel_job_t {
+    size_t index;       // sequence number of the job
+    const char* data;   // input to convert
+    size_t size;
+    size_t offset;      // offset of the data in the whole input
+    size_t count;       // number of top-level elements in the input
+    char* owned;        // buffer to free once the job is converted, if any
+    buffer_t output;    // reused between jobs in the same slot
+    buffer_t scratch;   // scratch space for the conversion, also reused
+    stats_t stats;      // counters for the job, only cleared if statistics are enabled
+    FILE* error_file;   // where the conversion reports errors
+    buffer_t errors;    // errors reported while converting the job
+    bool ok;
+    bool done;
+} parallel_job_t;
+
+// Converts the job's input into its output buffer. This is called on worker
+// threads; it should report its own errors to the job's error_file.
+typedef bool (*parallel_convert_t)(void* context, parallel_job_t* job);
+
+typedef struct parallel_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;  // a job was submitted, or we're finishing
+    pthread_cond_t job_done;   // a job was converted, or we're finishing
+    pthread_cond_t slot_free;  // a job was written, or we've failed
+
+    pthread_t* workers;
+    size_t worker_count;
+    pthread_t writer;
+
+    parallel_job_t* jobs; // ring of in-flight jobs indexed by sequence number
+    size_t depth;
+    size_t submitted;
+    size_t taken;
+    size_t written;
+    size_t first_failure; // index of the earliest job known to have failed
+
+    parallel_convert_t convert;
+    void* context;
+    FILE* file;
+    stats_t* stats; // totals of the jobs written, or NULL if disabled
+    bool flush;     // flush the file whenever the writer runs out of jobs
+
+    bool finishing;
+    bool failed;
+    bool write_error;
+} parallel_t;
+
+static void* parallel_worker(void* arg) {
+    parallel_t* parallel = (parallel_t*)arg;
+    pthread_mutex_lock(&parallel->mutex);
+
+    while (true) {
+        while (parallel->taken == parallel->submitted && !parallel->finishing)
+            pthread_cond_wait(&parallel->job_ready, &parallel->mutex);
+        if (parallel->taken == parallel->submitted)
+            break;
+
+        parallel_job_t* job = &parallel->jobs[parallel->taken++ % parallel->depth];
+        bool skip = parallel->failed || job->index > parallel->first_failure;
+        pthread_mutex_unlock(&parallel->mutex);
+
+        // Once a job has failed, jobs after it are drained without being
+        // converted. Jobs before it are still converted and written so that
+        // we output the same values as a serial conversion would.
+        //
+        // Errors are captured in the job rather than printed, so that only
+        // those of the first failed job are printed, by the writer. Without
+        // a memory stream they go straight to stderr.
+        char* text = NULL;
+        size_t text_size = 0;
+        job->error_file = skip ? NULL : open_memstream(&text, &text_size);
+        if (!job->error_file)
+            job->error_file = stderr;
+        double start = parallel->stats ? stats_now() : 0;
+        job->ok = !skip && parallel->convert(parallel->context, job);
+        if (parallel->stats)
+            job->stats.convert_seconds += stats_now() - start;
+        if (job->error_file != stderr) {
+            fclose(job->error_file);
+            if (!buffer_append(&job->errors, text, text_size))
+                fwrite(text, 1, text_size, stderr);
+            free(text);
+        }
+        free(job->owned);
+        job->owned = NULL;
+
+        pthread_mutex_lock(&parallel->mutex);
+        if (!job->ok && job->index < parallel->first_failure)
+            parallel->first_failure = job->index;
+        job->done = true;
+        pthread_cond_signal(&parallel->job_done);
+    }
+
+    pthread_mutex_unlock(&parallel->mutex);
+    return NULL;
+}
+
+// In flush mode, the writer flushes the file only when it has written
+// everything converted so far and is about to wait for more. A trickle of
+// input is then output as soon as each job is converted, while a busy
+// pipeline still writes in bulk.
+static void* parallel_writer(void* arg) {
+    parallel_t* parallel = (parallel_t*)arg;
+    bool unflushed = false;
+    pthread_mutex_lock(&parallel->mutex);
+
+    while (!parallel->failed) {
+        while (parallel->written == parallel->submitted ? !parallel->finishing :
+                !parallel->jobs[parallel->written % parallel->depth].done)
+        {
+            if (unflushed) {
+                pthread_mutex_unlock(&parallel->mutex);
+                bool flushed = fflush(parallel->file) == 0;
+                pthread_mutex_lock(&parallel->mutex);
+                unflushed = false;
+                if (!flushed) {
+                    parallel->write_error = true;
+                    parallel->failed = true;
+                    pthread_cond_broadcast(&parallel->slot_free);
+                    break;
+                }
+                continue;
+            }
+            pthread_cond_wait(&parallel->job_done, &parallel->mutex);
+        }
+        if (parallel->failed)
+            break;
+        if (parallel->written == parallel->submitted)
+            break;
+
+        parallel_job_t* job = &parallel->jobs[parallel->written % parallel->depth];
+        pthread_mutex_unlock(&parallel->mutex);
+
+        // The output of a failed job is written anyway so that we output the
+        // same partial JSON as a serial conversion would.
+        double start = parallel->stats ? stats_now() : 0;
+        bool wrote = fwrite(job->output.data, 1, job->output.size, parallel->file) == job->output.size;
+        if (job->errors.size > 0)
+            fwrite(job->errors.data, 1, job->errors.size, stderr);
+        if (parallel->stats) {
+            job->stats.write_seconds += stats_now() - start;
+            job->stats.bytes_out += job->output.size;
+            stats_add(parallel->stats, &job->stats);
+        }
+
+        unflushed = parallel->flush;
+
+        pthread_mutex_lock(&parallel->mutex);
+        if (!wrote)
+            parallel->write_error = true;
+        if (!wrote || !job->ok)
+            parallel->failed = true;
+        ++parallel->written;
+        pthread_cond_broadcast(&parallel->slot_free);
+    }
+
+    pthread_mutex_unlock(&parallel->mutex);
+    return NULL;
+}
+
+// If stats is not NULL, the counters of each job are added to it as the job
+// is written. It must not be accessed until parallel_finish() returns. If
+// flush is true, output is flushed whenever the writer catches up.
+static bool parallel_start(parallel_t* parallel, size_t threads, parallel_convert_t convert, void* context, FILE* file,
+        stats_t* stats, bool flush)
+{
+    memset(parallel, 0, sizeof(*parallel));
+    parallel->convert = convert;
+    parallel->context = context;
+    parallel->file = file;
+    parallel->stats = stats;
+    parallel->flush = flush;
+    parallel->depth = threads * PARALLEL_JOBS_PER_THREAD;
+    parallel->first_failure = SIZE_MAX;
+
+    parallel->jobs = (parallel_job_t*)calloc(parallel->depth, sizeof(parallel_job_t));
+    parallel->workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    if (!parallel->jobs || !parallel->workers) {
+        free(parallel->jobs);
+        free(parallel->workers);
+        return false;
+    }
+
+    pthread_mutex_init(&parallel->mutex, NULL);
+    pthread_cond_init(&parallel->job_ready, NULL);
+    pthread_cond_init(&parallel->job_done, NULL);
+    pthread_cond_init(&parallel->slot_free, NULL);
+
+    for (; parallel->worker_count < threads; ++parallel->worker_count)
+        if (pthread_create(&parallel->workers[parallel->worker_count], NULL, parallel_worker, parallel) != 0)
+            break;
+    if (parallel->worker_count == 0 || pthread_create(&parallel->writer, NULL, parallel_writer, parallel) != 0) {
+        pthread_mutex_lock(&parallel->mutex);
+        parallel->finishing = true;
+        pthread_cond_broadcast(&parallel->job_ready);
+        pthread_mutex_unlock(&parallel->mutex);
+        for (size_t i = 0; i < parallel->worker_count; ++i)
+            pthread_join(parallel->workers[i], NULL);
+        free(parallel->jobs);
+        free(parallel->workers);
+        return false;
+    }
+
+    return true;
+}
+
+// Returns the next job to fill in, waiting for a free slot if necessary. The
+// job must then be submitted with parallel_submit(). Returns NULL if a job
+// has failed, in which case no more jobs should be submitted.
+static parallel_job_t* parallel_next_job(parallel_t* parallel) {
+    pthread_mutex_lock(&parallel->mutex);
+    while (parallel->submitted - parallel->written == parallel->depth && !parallel->failed)
+        pthread_cond_wait(&parallel->slot_free, &parallel->mutex);
+    bool failed = parallel->failed || parallel->first_failure != SIZE_MAX;
+    pthread_mutex_unlock(&parallel->mutex);
+    if (failed)
+        return NULL;
+
+    parallel_job_t* job = &parallel->jobs[parallel->submitted % parallel->depth];
+    job->index = parallel->submitted;
+    job->data = NULL;
+    job->size = 0;
+    job->offset = 0;
+    job->count = 0;
+    job->owned = NULL;
+    job->output.size = 0;
+    job->errors.size = 0;
+    // The stats include the histograms, which are too large to clear for
+    // every job when statistics are disabled.
+    if (parallel->stats)
+        memset(&job->stats, 0, sizeof(job->stats));
+    job->ok = false;
+    job->done = false;
+    return job;
+}
+
+static void parallel_submit(parallel_t* parallel) {
+    pthread_mutex_lock(&parallel->mutex);
+    ++parallel->submitted;
+    pthread_cond_signal(&parallel->job_ready);
+    pthread_mutex_unlock(&parallel->mutex);
+}
+
+// Waits for all submitted jobs to be converted and written, and stops the
+// threads. Returns false if any job failed or output could not be written.
+static bool parallel_finish(parallel_t* parallel) {
+    pthread_mutex_lock(&parallel->mutex);
+    parallel->finishing = true;
+    pthread_cond_broadcast(&parallel->job_ready);
+    pthread_cond_broadcast(&parallel->job_done);
+    pthread_mutex_unlock(&parallel->mutex);
+
+    for (size_t i = 0; i < parallel->worker_count; ++i)
+        pthread_join(parallel->workers[i], NULL);
+    pthread_join(parallel->writer, NULL);
+
+    for (size_t i = 0; i < parallel->depth; ++i) {
+        buffer_destroy(&parallel->jobs[i].output);
+        buffer_destroy(&parallel->jobs[i].scratch);
+        buffer_destroy(&parallel->jobs[i].errors);
+    }
+    free(parallel->jobs);
+    free(parallel->workers);
+
+    pthread_mutex_destroy(&parallel->mutex);
+    pthread_cond_destroy(&parallel->job_ready);
+    pthread_cond_destroy(&parallel->job_done);
+    pthread_cond_destroy(&parallel->slot_free);
+
+    return !parallel->failed;
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_SELECT_H
+#define MSGPACK_TOOLS_SELECT_H 1
+
+// Path selection for msgpack2json (-e.) Each path is a JSONPath-like
+// expression naming values inside a top-level element; only the values
+// matching a path are converted, and the rest of the element is skipped
+// without decoding it.
+//
+// A path is an optional "$" followed by any number of steps:
+//
+//     .name      the value of a map key
+//     ["name"]   the same, for keys containing other characters ('\' escapes)
+//     .*         the values of all keys in a map
+//     [n]        the nth element of an array, starting from 0
+//     [*]        all elements of an array
+//
+// A path with no steps ("$" or ".") selects the whole element.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The maximum number of paths, so that the set of paths a value is being
+// matched against fits in a 64-bit mask.
+#define SELECT_MAX_PATHS 64
+
+typedef enum select_step_type_t {
+    select_key,
+    select_index,
+    select_any_key,
+    select_any_index,
+} select_step_type_t;
+
+typedef struct select_step_t {
+    select_step_type_t type;
+    const char* key;
+    size_t key_len;
+    uint32_t index;
+} select_step_t;
+
+typedef struct select_path_t {
+    select_step_t* steps;
+    size_t count;
+    char* keys; // storage for the keys of the steps
+} select_path_t;
+
+typedef struct select_t {
+    select_path_t paths[SELECT_MAX_PATHS];
+    size_t count;
+} select_t;
+
+// Returns the mask of all paths.
+static inline uint64_t select_all(const select_t* select) {
+    return select->count == SELECT_MAX_PATHS ? ~(uint64_t)0 : ((uint64_t)1 << select->count) - 1;
+}
+
+static bool select_is_name_char(char c) {
+    return c != '\0' && c != '.' && c != '[';
+}
+
+// Parses a path and adds it to the selection. On error, message is set.
+static bool select_add(select_t* select, const char* expression, const char** message) {
+    if (select->count == SELECT_MAX_PATHS) {
+        *message = "too many paths";
+        return false;
+    }
+
+    // Each step is at least two characters and the unescaped keys are no
+    // longer than the expression, so these are big enough.
+    size_t length = strlen(expression);
+    select_path_t path;
+    path.count = 0;
+    path.steps = (select_step_t*)malloc((length / 2 + 1) * sizeof(select_step_t));
+    path.keys = (char*)malloc(length + 1);
+    if (!path.steps || !path.keys) {
+        free(path.steps);
+        free(path.keys);
+        *message = "allocation failure";
+        return false;
+    }
+
+    const char* p = expression;
+    char* keys = path.keys;
+    if (*p == '$')
+        ++p;
+    else if (p[0] == '.' && p[1] == '\0')
+        ++p;
+
+    *message = NULL;
+    while (*p && !*message) {
+        select_step_t* step = &path.steps[path.count++];
+        if (p[0] == '.' && p[1] == '*') {
+            step->type = select_any_key;
+            p += 2;
+        } else if (p[0] == '.') {
+            const char* start = ++p;
+            while (select_is_name_char(*p))
+                ++p;
+            if (p == start) {
+                *message = "expected a key after '.'";
+                break;
+            }
+            step->type = select_key;
+            step->key = keys;
+            step->key_len = (size_t)(p - start);
+            memcpy(keys, start, step->key_len);
+            keys += step->key_len;
+        } else if (p[0] == '[' && p[1] == '*' && p[2] == ']') {
+            step->type = select_any_index;
+            p += 3;
+        } else if (p[0] == '[' && p[1] == '"') {
+            p += 2;
+            step->type = select_key;
+            step->key = keys;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1])
+                    ++p;
+                *keys++ = *p++;
+            }
+            step->key_len = (size_t)(keys - step->key);
+            if (p[0] != '"' || p[1] != ']') {
+                *message = "unterminated key";
+                break;
+            }
+            p += 2;
+        } else if (p[0] == '[' && p[1] >= '0' && p[1] <= '9') {
+            char* end;
+            errno = 0;
+            unsigned long long index = strtoull(p + 1, &end, 10);
+            if (errno != 0 || index > UINT32_MAX || *end != ']') {
+                *message = "invalid array index";
+                break;
+            }
+            step->type = select_index;
+            step->index = (uint32_t)index;
+            p = end + 1;
+        } else {
+            *message = "expected '.' or '['";
+        }
+    }
+
+    if (*message) {
+        free(path.steps);
+        free(path.keys);
+        return false;
+    }
+    select->paths[select->count++] = path;
+    return true;
+}
+
+static void select_destroy(select_t* select) {
+    for (size_t i = 0; i < select->count; ++i) {
+        free(select->paths[i].steps);
+        free(select->paths[i].keys);
+    }
+    select->count = 0;
+}
+
+// Returns true if any of the paths ends at the given depth.
+static inline bool select_ends(const select_t* select, uint64_t paths, size_t depth) {
+    for (size_t i = 0; i < select->count; ++i)
+        if (((paths >> i) & 1) && select->paths[i].count == depth)
+            return true;
+    return false;
+}
+
+// Returns the paths whose step at the given depth matches the array index.
+static inline uint64_t select_match_index(const select_t* select, uint64_t paths, size_t depth, uint32_t index) {
+    uint64_t matched = 0;
+    for (size_t i = 0; i < select->count; ++i) {
+        if (!((paths >> i) & 1))
+            continue;
+        const select_step_t* step = &select->paths[i].steps[depth];
+        if (step->type == select_any_index || (step->type == select_index && step->index == index))
+            matched |= (uint64_t)1 << i;
+    }
+    return matched;
+}
+
+// Returns the paths whose step at the given depth could match a map key of
+// the given length. The named keys must then be compared with
+// select_match_key(); keys of other lengths never need to be read.
+static inline uint64_t select_match_key_length(const select_t* select, uint64_t paths, size_t depth,
+        size_t length, uint64_t* named)
+{
+    uint64_t matched = 0;
+    *named = 0;
+    for (size_t i = 0; i < select->count; ++i) {
+        if (!((paths >> i) & 1))
+            continue;
+        const select_step_t* step = &select->paths[i].steps[depth];
+        if (step->type == select_any_key)
+            matched |= (uint64_t)1 << i;
+        else if (step->type == select_key && step->key_len == length)
+            *named |= (uint64_t)1 << i;
+    }
+    return matched;
+}
+
+// Returns the named paths whose key at the given depth is the given key.
+static inline uint64_t select_match_key(const select_t* select, uint64_t named, size_t depth,
+        const char* key, size_t length)
+{
+    uint64_t matched = 0;
+    for (size_t i = 0; i < select->count; ++i)
+        if (((named >> i) & 1) && memcmp(select->paths[i].steps[depth].key, key, length) == 0)
+            matched |= (uint64_t)1 << i;
+    return matched;
+}
+
+#endif
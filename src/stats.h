@@ -0,0 +1,262 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSGPACK_TOOLS_STATS_H
+#define MSGPACK_TOOLS_STATS_H 1
+
+// Conversion statistics, reported with -s (or -S for JSON.)
+//
+// Counters are only updated when statistics are enabled; the conversion
+// routines take a NULL stats pointer otherwise, so the cost when disabled is
+// a predictable branch per value.
+//
+// With -H, the conversion also records the time taken and the input size of
+// each top-level record in histograms, which are printed at exit and
+// whenever the process receives SIGUSR1.
+
+#include "common.h"
+#include "histogram.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// The maximum number of value types counted. Both tools count values by
+// their MessagePack type (the mpack_type_t enum.)
+#define STATS_MAX_TYPES 16
+
+typedef enum stats_mode_t {
+    stats_off = 0,
+    stats_text,
+    stats_json,
+} stats_mode_t;
+
+typedef struct stats_t {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t records;       // top-level values
+    uint64_t base64_bytes;  // binary bytes converted to or from base64
+    uint64_t types[STATS_MAX_TYPES];
+
+    // Time spent waiting on input, converting, and waiting on output. In
+    // parallel mode, convert time is the sum over all worker threads.
+    double read_seconds;
+    double convert_seconds;
+    double write_seconds;
+
+    // per-record histograms, if enabled with -H
+    histogram_t latency; // nanoseconds
+    histogram_t sizes;   // bytes of input
+} stats_t;
+
+static inline double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Names of the MessagePack types counted in statistics
+static void stats_type_names(const char** names) {
+    memset(names, 0, sizeof(const char*) * STATS_MAX_TYPES);
+    names[mpack_type_nil] = "nil";
+    names[mpack_type_bool] = "bool";
+    names[mpack_type_float] = "float";
+    names[mpack_type_double] = "double";
+    names[mpack_type_int] = "int";
+    names[mpack_type_uint] = "uint";
+    names[mpack_type_str] = "str";
+    names[mpack_type_bin] = "bin";
+    names[mpack_type_ext] = "ext";
+    names[mpack_type_array] = "array";
+    names[mpack_type_map] = "map";
+}
+
+// SIGUSR1 asks for the histograms so far to be printed. The signal is
+// blocked in every thread and taken with sigwait() by a reporter thread,
+// which answers it right away even while the tool is idle waiting for input.
+// The reporter prints the totals under stats_signal_mutex, which
+// stats_record() and stats_add() also hold while they update the totals, so
+// the histograms are never printed half-updated. Signals are process-wide, so
+// the reporter is as well.
+static pthread_mutex_t stats_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* stats_signal_command;
+static stats_mode_t stats_signal_mode;
+static const stats_t* stats_signal_totals; // NULL once the reporter is stopped
+static pthread_t stats_signal_thread;
+
+// Only the totals the reporter prints need the lock.
+static inline void stats_lock(const stats_t* stats) {
+    if (stats == stats_signal_totals)
+        pthread_mutex_lock(&stats_signal_mutex);
+}
+
+static inline void stats_unlock(const stats_t* stats) {
+    if (stats == stats_signal_totals)
+        pthread_mutex_unlock(&stats_signal_mutex);
+}
+
+// Adds the counters of a job to the totals.
+static inline void stats_add(stats_t* total, const stats_t* job) {
+    stats_lock(total);
+    total->bytes_in += job->bytes_in;
+    total->bytes_out += job->bytes_out;
+    total->records += job->records;
+    total->base64_bytes += job->base64_bytes;
+    for (size_t i = 0; i < STATS_MAX_TYPES; ++i)
+        total->types[i] += job->types[i];
+    total->read_seconds += job->read_seconds;
+    total->convert_seconds += job->convert_seconds;
+    total->write_seconds += job->write_seconds;
+    histogram_add(&total->latency, &job->latency);
+    histogram_add(&total->sizes, &job->sizes);
+    stats_unlock(total);
+}
+
+// Records a top-level record in the histograms, given the time at which its
+// conversion started, the time spent waiting for input since then (which
+// isn't counted as latency) and its size in bytes.
+static inline void stats_record(stats_t* stats, double start, double read_seconds, uint64_t bytes) {
+    double seconds = stats_now() - start - read_seconds;
+    uint64_t nanoseconds = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+    stats_lock(stats);
+    histogram_record(&stats->latency, nanoseconds);
+    histogram_record(&stats->sizes, bytes);
+    stats_unlock(stats);
+}
+
+// Prints the histograms to stderr.
+static void stats_report_histograms(const char* command, stats_mode_t mode, const stats_t* stats) {
+    if (mode == stats_json) {
+        fprintf(stderr, "{\"command\":\"%s\",\"latency_us\":{", command);
+        histogram_print_json(stderr, &stats->latency, 1e3);
+        fprintf(stderr, "},\"size_bytes\":{");
+        histogram_print_json(stderr, &stats->sizes, 1);
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    fprintf(stderr, "%s: record latency (us): ", command);
+    histogram_print_text(stderr, &stats->latency, 1e3);
+    fprintf(stderr, "%s: record size (bytes): ", command);
+    histogram_print_text(stderr, &stats->sizes, 1);
+}
+
+static void* stats_signal_reporter(void* arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (true) {
+        int received;
+        if (sigwait(&signals, &received) != 0)
+            continue;
+        pthread_mutex_lock(&stats_signal_mutex);
+        const stats_t* totals = stats_signal_totals;
+        if (totals)
+            stats_report_histograms(stats_signal_command, stats_signal_mode, totals);
+        pthread_mutex_unlock(&stats_signal_mutex);
+        if (!totals)
+            break;
+    }
+    return NULL;
+}
+
+// Starts the reporter for the given totals. This must be called before any
+// other thread is started so that they all inherit the blocked signal. If
+// the reporter can't be started, SIGUSR1 is left alone.
+static void stats_start_reporter(const char* command, stats_mode_t mode, const stats_t* totals) {
+    sigset_t signals, old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    stats_signal_command = command;
+    stats_signal_mode = mode;
+    stats_signal_totals = totals;
+    if (pthread_create(&stats_signal_thread, NULL, stats_signal_reporter, NULL) != 0) {
+        stats_signal_totals = NULL;
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    }
+}
+
+// Stops the reporter once the totals are final. SIGUSR1 stays blocked, so a
+// later signal is ignored.
+static void stats_stop_reporter(void) {
+    pthread_mutex_lock(&stats_signal_mutex);
+    bool running = stats_signal_totals != NULL;
+    stats_signal_totals = NULL;
+    pthread_mutex_unlock(&stats_signal_mutex);
+    if (running) {
+        pthread_kill(stats_signal_thread, SIGUSR1);
+        pthread_join(stats_signal_thread, NULL);
+    }
+}
+
+// Prints the statistics to stderr. seconds is the total wall clock time.
+static void stats_report(const char* command, stats_mode_t mode, const stats_t* stats, double seconds) {
+    const char* type_names[STATS_MAX_TYPES];
+    stats_type_names(type_names);
+    struct rusage usage;
+    long peak_rss_kb = (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;
+    double rate = seconds > 0 ? 1.0 / seconds : 0;
+
+    if (mode == stats_json) {
+        fprintf(stderr, "{\"command\":\"%s\",\"bytes_in\":%llu,\"bytes_out\":%llu,\"records\":%llu,"
+                "\"base64_bytes\":%llu,\"types\":{", command, (unsigned long long)stats->bytes_in,
+                (unsigned long long)stats->bytes_out, (unsigned long long)stats->records,
+                (unsigned long long)stats->base64_bytes);
+        bool first = true;
+        for (size_t i = 0; i < STATS_MAX_TYPES; ++i) {
+            if (!type_names[i])
+                continue;
+            fprintf(stderr, "%s\"%s\":%llu", first ? "" : ",", type_names[i], (unsigned long long)stats->types[i]);
+            first = false;
+        }
+        fprintf(stderr, "},\"seconds\":%.6f,\"read_seconds\":%.6f,\"convert_seconds\":%.6f,\"write_seconds\":%.6f,"
+                "\"peak_rss_kb\":%ld,\"records_per_second\":%.1f,\"mb_per_second\":%.2f}\n",
+                seconds, stats->read_seconds, stats->convert_seconds, stats->write_seconds,
+                peak_rss_kb, (double)stats->records * rate, (double)stats->bytes_in / 1e6 * rate);
+        return;
+    }
+
+    fprintf(stderr, "%s: statistics:\n", command);
+    fprintf(stderr, "    bytes in:       %llu\n", (unsigned long long)stats->bytes_in);
+    fprintf(stderr, "    bytes out:      %llu\n", (unsigned long long)stats->bytes_out);
+    fprintf(stderr, "    records:        %llu\n", (unsigned long long)stats->records);
+    fprintf(stderr, "    base64 bytes:   %llu\n", (unsigned long long)stats->base64_bytes);
+    for (size_t i = 0; i < STATS_MAX_TYPES; ++i)
+        if (type_names[i])
+            fprintf(stderr, "    %-8s values: %llu\n", type_names[i], (unsigned long long)stats->types[i]);
+    fprintf(stderr, "    time:           %.6f s (read %.6f s, convert %.6f s, write %.6f s)\n",
+            seconds, stats->read_seconds, stats->convert_seconds, stats->write_seconds);
+    fprintf(stderr, "    peak RSS:       %ld KB\n", peak_rss_kb);
+    fprintf(stderr, "    throughput:     %.1f records/s, %.2f MB/s\n",
+            (double)stats->records * rate, (double)stats->bytes_in / 1e6 * rate);
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MSGPACK_TOOLS_UTF8_H
+#define MSGPACK_TOOLS_UTF8_H 1
+
+// UTF-8 validation for msgpack2json -V. Strings can be validated in pieces,
+// with the state carried from one piece to the next, so that large strings
+// read in chunks don't need to be in memory all at once.
+//
+// Runs of ASCII are checked eight bytes at a time; the rest follows the
+// well-formed byte sequences of the Unicode standard (table 3-7), which
+// excludes overlong encodings, surrogates and code points past U+10FFFF.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct utf8_state_t {
+    uint8_t needed; // continuation bytes still expected
+    uint8_t lower;  // range of the next continuation byte
+    uint8_t upper;
+} utf8_state_t;
+
+// Checks a piece of a string. Returns false if it is invalid, in which case
+// error is set to the offset in the piece of the first invalid byte.
+static bool utf8_validate(utf8_state_t* state, const char* data, size_t length, size_t* error) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + length;
+
+    while (p != end) {
+        if (state->needed > 0) {
+            if (*p < state->lower || *p > state->upper) {
+                *error = (size_t)(p - (const uint8_t*)data);
+                return false;
+            }
+            state->lower = 0x80;
+            state->upper = 0xBF;
+            --state->needed;
+            ++p;
+            continue;
+        }
+
+        while (end - p >= 8) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            if (word & UINT64_C(0x8080808080808080))
+                break;
+            p += 8;
+        }
+        if (p == end)
+            break;
+
+        uint8_t c = *p;
+        if (c < 0x80) {
+            ++p;
+            continue;
+        }
+
+        state->lower = 0x80;
+        state->upper = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            state->needed = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            state->needed = 2;
+            if (c == 0xE0)
+                state->lower = 0xA0; // overlong
+            else if (c == 0xED)
+                state->upper = 0x9F; // surrogates
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            state->needed = 3;
+            if (c == 0xF0)
+                state->lower = 0x90; // overlong
+            else if (c == 0xF4)
+                state->upper = 0x8F; // past U+10FFFF
+        } else {
+            *error = (size_t)(p - (const uint8_t*)data);
+            return false;
+        }
+        ++p;
+    }
+    return true;
+}
+
+// Returns true if the string ended on a whole character.
+static inline bool utf8_complete(const utf8_state_t* state) {
+    return state->needed == 0;
+}
+
+#endif
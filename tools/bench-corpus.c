@@ -0,0 +1,258 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Generates a synthetic JSON corpus for the benchmarks (see tools/bench.sh.)
+//
+// The output depends only on the shape and the record count. We use our own
+// random number generator and format all numbers from integers so that the
+// corpus is identical on every platform.
+//
+// Every shape except "stream" is a single top-level array of records, one per
+// line. The "stream" shape is a sequence of top-level objects, one per line,
+// for continuous mode.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// xorshift64*
+static uint64_t random_state;
+
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+static uint32_t random_below(uint32_t limit) {
+    return (uint32_t)((random_next() >> 32) % limit);
+}
+
+static void put_number(void) {
+    switch (random_below(6)) {
+        case 0: // small integer
+            printf("%u", random_below(1000));
+            break;
+        case 1: // negative integer
+            printf("-%u", random_below(100000000));
+            break;
+        case 2: // large integer
+            printf("%llu", (unsigned long long)random_next());
+            break;
+        case 3: // short decimal
+            printf("%u.%02u", random_below(10000), random_below(100));
+            break;
+        case 4: // long decimal
+            printf("%s%u.%09u%08u", random_below(2) ? "-" : "",
+                    random_below(1000), random_below(1000000000), random_below(100000000));
+            break;
+        default: // exponent
+            printf("%u.%06ue%s%u", 1 + random_below(9), random_below(1000000),
+                    random_below(2) ? "-" : "", random_below(300));
+            break;
+    }
+}
+
+static const char* const words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa",
+};
+
+// Writes a string of roughly the given length. Most of it is plain words;
+// some strings contain characters that need escaping and multi-byte UTF-8.
+static void put_string(uint32_t length) {
+    bool special = random_below(4) == 0;
+    putchar('"');
+    uint32_t written = 0;
+    while (written < length) {
+        const char* word = words[random_below(sizeof(words) / sizeof(*words))];
+        fputs(word, stdout);
+        written += (uint32_t)strlen(word);
+        if (special && random_below(8) == 0) {
+            static const char* const escapes[] = {"\\\"", "\\\\", "\\n", "\\t", "\\u0001", "\xc3\xa9", "\xe2\x82\xac"};
+            fputs(escapes[random_below(sizeof(escapes) / sizeof(*escapes))], stdout);
+            written += 2;
+        }
+        putchar(' ');
+        ++written;
+    }
+    putchar('"');
+}
+
+static void put_base64(uint32_t length, bool prefix) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    fputs(prefix ? "\"base64:" : "\"", stdout);
+    for (uint32_t i = 0; i < length; i += 3) {
+        uint32_t bits = (uint32_t)(random_next() >> 40);
+        uint32_t count = (length - i < 3) ? length - i : 3;
+        bits &= 0xFFFFFF << (8 * (3 - count)); // keep padding canonical
+        putchar(table[(bits >> 18) & 63]);
+        putchar(table[(bits >> 12) & 63]);
+        putchar(count > 1 ? table[(bits >> 6) & 63] : '=');
+        putchar(count > 2 ? table[bits & 63] : '=');
+    }
+    putchar('"');
+}
+
+static void put_numbers_record(uint32_t index) {
+    putchar('[');
+    for (int i = 0; i < 16; ++i) {
+        if (i)
+            putchar(',');
+        put_number();
+    }
+    putchar(']');
+}
+
+static void put_strings_record(uint32_t index) {
+    printf("{\"id\":\"%08x\",\"name\":", index);
+    put_string(8 + random_below(24));
+    fputs(",\"text\":", stdout);
+    put_string(64 + random_below(512));
+    fputs(",\"tags\":[", stdout);
+    for (uint32_t i = 0, count = random_below(6); i < count; ++i) {
+        if (i)
+            putchar(',');
+        put_string(4 + random_below(8));
+    }
+    fputs("]}", stdout);
+}
+
+static void put_blobs(uint32_t index, bool prefix) {
+    printf("{\"id\":%u,\"hash\":", index);
+    put_base64(32, prefix);
+    fputs(",\"data\":", stdout);
+    put_base64(64 + random_below(4096), prefix);
+    putchar('}');
+}
+
+// blobs with a "base64:" prefix, for -b
+static void put_blobs_record(uint32_t index) {
+    put_blobs(index, true);
+}
+
+// blobs without a prefix, for -B
+static void put_blobs_detect_record(uint32_t index) {
+    put_blobs(index, false);
+}
+
+static void put_nested_value(uint32_t depth) {
+    if (depth == 0) {
+        put_number();
+        return;
+    }
+    if (random_below(2)) {
+        fputs("{\"key\":", stdout);
+        put_nested_value(depth - 1);
+        fputs(",\"next\":[true,null,false]}", stdout);
+    } else {
+        putchar('[');
+        put_nested_value(depth - 1);
+        putchar(',');
+        put_number();
+        putchar(']');
+    }
+}
+
+static void put_nested_record(uint32_t index) {
+    put_nested_value(16 + random_below(48));
+}
+
+static void put_stream_record(uint32_t index) {
+    printf("{\"seq\":%u,\"time\":%u.%03u,\"level\":", index,
+            1500000000 + index, random_below(1000));
+    put_string(4 + random_below(4));
+    fputs(",\"message\":", stdout);
+    put_string(16 + random_below(96));
+    fputs(",\"values\":[", stdout);
+    for (uint32_t i = 0, count = 1 + random_below(8); i < count; ++i) {
+        if (i)
+            putchar(',');
+        put_number();
+    }
+    fputs("],\"ok\":", stdout);
+    fputs(random_below(8) ? "true" : "false", stdout);
+    putchar('}');
+}
+
+typedef struct shape_t {
+    const char* name;
+    void (*record)(uint32_t index);
+} shape_t;
+
+static const shape_t shapes[] = {
+    {"numbers", put_numbers_record},
+    {"strings", put_strings_record},
+    {"blobs", put_blobs_record},
+    {"blobs-detect", put_blobs_detect_record},
+    {"nested", put_nested_record},
+    {"stream", put_stream_record},
+};
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <numbers|strings|blobs|blobs-detect|nested|stream> <records>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const shape_t* shape = NULL;
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(*shapes); ++i)
+        if (strcmp(argv[1], shapes[i].name) == 0)
+            shape = &shapes[i];
+    if (!shape) {
+        fprintf(stderr, "%s: unknown shape \"%s\"\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    char* end;
+    unsigned long records = strtoul(argv[2], &end, 10);
+    if (*argv[2] == '\0' || *end != '\0' || records == 0 || records > UINT32_MAX) {
+        fprintf(stderr, "%s: invalid record count \"%s\"\n", argv[0], argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    // each shape has its own fixed seed
+    random_state = 0x9E3779B97F4A7C15ull ^ (uint64_t)(shape - shapes);
+
+    bool stream = (shape->record == put_stream_record);
+    if (!stream)
+        puts("[");
+    for (uint32_t i = 0; i < (uint32_t)records; ++i) {
+        shape->record(i);
+        if (!stream && i + 1 != records)
+            putchar(',');
+        putchar('\n');
+    }
+    if (!stream)
+        puts("]");
+
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "%s: error writing output\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
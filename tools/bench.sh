@@ -0,0 +1,102 @@
+#!/bin/bash
+# Runs the throughput benchmarks. A synthetic corpus is generated for each
+# shape (see tools/bench-corpus.c) and both tools are run over it in each
+# mode. Prints one JSON object per line for each tool and mode with the input
+# size, records converted, best time, MB/s, records/s and peak RSS.
+#
+# Environment:
+#     BENCH_SCALE  Corpus size multiplier (default 10, about 40 MB per shape)
+#     BENCH_RUNS   Runs of each mode; the fastest is reported (default 3)
+
+if ! [ -e ./msgpack2json ] || ! [ -e ./json2msgpack ]; then
+    echo "Build msgpack2json and json2msgpack first."
+    exit 1
+fi
+if ! [ -e .build/bench-corpus ] || ! [ -e .build/bench-run ]; then
+    echo "Build the benchmark tools first with \"make bench\"."
+    exit 1
+fi
+
+SCALE=${BENCH_SCALE:-10}
+RUNS=${BENCH_RUNS:-3}
+DIR=.build/bench
+
+mkdir -p $DIR
+
+declare -A RECORDS
+RECORDS[numbers]=$((20000 * SCALE))
+RECORDS[strings]=$((10000 * SCALE))
+RECORDS[blobs]=$((1500 * SCALE))
+RECORDS[blobs-detect]=$((1500 * SCALE))
+RECORDS[nested]=$((4000 * SCALE))
+RECORDS[stream]=$((20000 * SCALE))
+
+# Generates the JSON and MessagePack corpus for a shape unless it already
+# exists at this scale.
+corpus() {
+    SHAPE=$1
+    BASE=$DIR/$SHAPE-${RECORDS[$SHAPE]}
+    if ! [ -e $BASE.mp ]; then
+        .build/bench-corpus $SHAPE ${RECORDS[$SHAPE]} > $BASE.json || exit 1
+        ./json2msgpack -b -B 22 -i $BASE.json -o $BASE.mp || exit 1
+    fi
+}
+
+bench() {
+    TOOL=$1
+    MODE=$2
+    SHAPE=$3
+    shift
+    shift
+    shift
+
+    if [ $TOOL = json2msgpack ]; then
+        INPUT=$DIR/$SHAPE-${RECORDS[$SHAPE]}.json
+    else
+        INPUT=$DIR/$SHAPE-${RECORDS[$SHAPE]}.mp
+    fi
+    BYTES=$(wc -c < $INPUT)
+
+    BEST=
+    PEAK=0
+    for i in $(seq $RUNS); do
+        RESULT=$(.build/bench-run ./$TOOL "$@" -i $INPUT) || exit 1
+        read SECONDS_TAKEN RSS <<< "$RESULT"
+        if [ -z "$BEST" ] || awk "BEGIN {exit !($SECONDS_TAKEN < $BEST)}"; then
+            BEST=$SECONDS_TAKEN
+        fi
+        if [ $RSS -gt $PEAK ]; then
+            PEAK=$RSS
+        fi
+    done
+
+    awk -v tool=$TOOL -v mode=$MODE -v bytes=$BYTES -v records=${RECORDS[$SHAPE]} \
+            -v seconds=$BEST -v rss=$PEAK 'BEGIN {
+        printf "{\"tool\":\"%s\",\"mode\":\"%s\",\"bytes\":%d,\"records\":%d,\"seconds\":%.6f,", tool, mode, bytes, records, seconds
+        printf "\"mb_per_s\":%.2f,\"records_per_s\":%.0f,\"peak_rss_kb\":%d}\n", bytes / 1e6 / seconds, records / seconds, rss
+    }'
+}
+
+for SHAPE in numbers strings blobs blobs-detect nested stream; do
+    corpus $SHAPE
+done
+
+bench json2msgpack numbers numbers
+bench json2msgpack numbers-float numbers -f
+bench json2msgpack strings strings
+bench json2msgpack blobs-b blobs -b
+bench json2msgpack blobs-B blobs-detect -B 22
+bench json2msgpack nested nested
+bench json2msgpack stream stream
+bench json2msgpack stream-j4 stream -j 4
+
+bench msgpack2json numbers numbers
+bench msgpack2json numbers-pretty numbers -p
+bench msgpack2json strings strings
+bench msgpack2json blobs-b blobs -b
+bench msgpack2json blobs-B blobs -B
+bench msgpack2json nested nested
+bench msgpack2json stream stream -c
+bench msgpack2json stream-j4 stream -c -j 4
+bench msgpack2json stream-a1024 stream -c -a 1024
+bench msgpack2json stream-select stream -c -e .seq
@@ -0,0 +1,136 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// Converts a file with libmsgpacktools and writes the result to stdout. This
+// is used by tools/test.sh to test the library against the same expected
+// output as the tools.
+//
+// Usage: lib-test <msgpack2json|json2msgpack> <buffer|stream> <file> [<flags>]
+//
+// The flags are the tool's single-letter options that take no argument: p, c,
+// C, b and B for msgpack2json, and l, f and b for json2msgpack. In stream
+// mode, the flag a makes the output callback abort after the first chunk; the
+// exit status is 2 if the callback is called again after that.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgpacktools.h"
+
+static bool write_stdout(void* context, const char* data, size_t size) {
+    (void)context;
+    return fwrite(data, 1, size, stdout) == size;
+}
+
+// Writes the first chunk and aborts on the next. context counts the calls.
+static bool write_abort(void* context, const char* data, size_t size) {
+    int* calls = (int*)context;
+    return ++*calls == 1 && write_stdout(NULL, data, size);
+}
+
+static char* read_file(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    size_t capacity = 4096;
+    char* data = (char*)malloc(capacity);
+    *size = 0;
+    size_t n;
+    while (data && (n = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        *size += n;
+        if (*size == capacity) {
+            capacity *= 2;
+            char* grown = (char*)realloc(data, capacity);
+            if (!grown)
+                free(data);
+            data = grown;
+        }
+    }
+    if (ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s <msgpack2json|json2msgpack> <buffer|stream> <file> [<flags>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    bool to_json = strcmp(argv[1], "msgpack2json") == 0;
+    bool stream = strcmp(argv[2], "stream") == 0;
+    const char* flags = argc == 5 ? argv[4] : "";
+    int calls = 0;
+    msgpacktools_write_t write_output = strchr(flags, 'a') != NULL ? write_abort : write_stdout;
+
+    size_t size;
+    char* data = read_file(argv[3], &size);
+    if (!data) {
+        fprintf(stderr, "%s: could not read \"%s\"\n", argv[0], argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    bool ok;
+    char* output = NULL;
+    size_t output_size = 0;
+    if (to_json) {
+        msgpack2json_options_t options;
+        memset(&options, 0, sizeof(options));
+        options.pretty = strchr(flags, 'p') != NULL;
+        options.continuous = strchr(flags, 'c') != NULL || strchr(flags, 'C') != NULL;
+        options.delimiter = strchr(flags, 'C') != NULL ? ',' : '\0';
+        options.base64 = strchr(flags, 'b') != NULL || strchr(flags, 'B') != NULL;
+        options.base64_prefix = strchr(flags, 'b') != NULL;
+        if (stream)
+            ok = msgpack2json_convert_stream(&options, data, size, write_output, &calls);
+        else
+            ok = msgpack2json_convert(&options, data, size, &output, &output_size);
+    } else {
+        json2msgpack_options_t options;
+        memset(&options, 0, sizeof(options));
+        options.lax = strchr(flags, 'l') != NULL;
+        options.use_float = strchr(flags, 'f') != NULL;
+        options.base64_prefix = strchr(flags, 'b') != NULL;
+        if (stream)
+            ok = json2msgpack_convert_stream(&options, data, size, write_output, &calls);
+        else
+            ok = json2msgpack_convert(&options, data, size, &output, &output_size);
+    }
+
+    if (ok && output && fwrite(output, 1, output_size, stdout) != output_size)
+        ok = false;
+    free(output);
+    free(data);
+    if (fflush(stdout) != 0)
+        ok = false;
+    if (calls > 2) {
+        fprintf(stderr, "%s: output continued after the callback aborted\n", argv[0]);
+        return 2;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
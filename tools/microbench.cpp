@@ -0,0 +1,379 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Microbenchmarks for the hot conversion routines, run in isolation over
+// inputs of various sizes. Build and run with "make microbench".
+//
+// We include msgpack2json.cpp directly so that we call its own routines
+// (string(), base64_bin(), describe_bin() and number()) rather than copies
+// of them. json2msgpack's convert_base64() is a scratch buffer around
+// base64_decode(), which we benchmark directly, as we do the kernels in the
+// shared headers.
+//
+// Prints one JSON object per kernel and size with the time per operation and
+// per input byte.
+//
+// Usage: microbench [-t <milliseconds>] [<kernel>...]
+
+#define MSGPACK2JSON_NO_MAIN 1
+#include "../src/msgpack2json.cpp"
+
+#include <time.h>
+
+// The input to a kernel, prepared once for each size.
+typedef struct sample_t {
+    buffer_t data;       // input bytes (MessagePack, base64, etc.)
+    buffer_t output;     // output, reused for each run
+    buffer_t scratch;    // scratch space for the routines that need it
+    size_t bytes;        // input size in bytes
+    size_t ops;          // operations per run (values converted)
+    options_t options;
+} sample_t;
+
+typedef struct kernel_t {
+    const char* name;
+    void (*prepare)(sample_t* input, size_t size);
+    size_t (*run)(sample_t* input);
+} kernel_t;
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+// xorshift64*
+static uint64_t random_next() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void append_or_die(buffer_t* buffer, const char* data, size_t size) {
+    if (!buffer_append(buffer, data, size)) {
+        fprintf(stderr, "microbench: allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void random_bytes(buffer_t* buffer, size_t size) {
+    while (size > 0) {
+        uint64_t value = random_next();
+        size_t count = size < sizeof(value) ? size : sizeof(value);
+        append_or_die(buffer, (const char*)&value, count);
+        size -= count;
+    }
+}
+
+// Mostly plain text with an occasional character that needs escaping.
+static void random_text(buffer_t* buffer, size_t size) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    for (size_t i = 0; i < size; ++i) {
+        char c = text[i % (sizeof(text) - 1)];
+        if ((random_next() & 63) == 0)
+            c = "\"\\\n\t"[random_next() & 3];
+        append_or_die(buffer, &c, 1);
+    }
+}
+
+static void write_header(sample_t* input, mpack_type_t type, uint32_t length) {
+    char header[8];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, header, sizeof(header));
+    if (type == mpack_type_str)
+        mpack_start_str(&writer, length);
+    else
+        mpack_start_bin(&writer, length);
+    append_or_die(&input->data, header, mpack_writer_buffer_used(&writer));
+    mpack_writer_destroy(&writer);
+}
+
+static void prepare_text(sample_t* input, size_t size) {
+    random_text(&input->data, size);
+}
+
+static void prepare_bytes(sample_t* input, size_t size) {
+    random_bytes(&input->data, size);
+}
+
+static void prepare_base64(sample_t* input, size_t size) {
+    // encode enough bytes for a base64 string of the given size
+    buffer_t bytes = {NULL, 0, 0};
+    random_bytes(&bytes, size / 4 * 3);
+    char* encoded = buffer_scratch(&input->data, base64_encoded_size(bytes.size));
+    if (!encoded) {
+        fprintf(stderr, "microbench: allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    input->data.size = base64_encode(bytes.data, bytes.size, encoded);
+    buffer_destroy(&bytes);
+}
+
+static void prepare_str(sample_t* input, size_t size) {
+    write_header(input, mpack_type_str, (uint32_t)size);
+    random_text(&input->data, size);
+}
+
+static void prepare_bin(sample_t* input, size_t size) {
+    write_header(input, mpack_type_bin, (uint32_t)size);
+    random_bytes(&input->data, size);
+}
+
+// Doubles with a mix of magnitudes and digit counts; size is in bytes of
+// doubles.
+static void prepare_doubles(sample_t* input, size_t size) {
+    input->ops = size / sizeof(double);
+    for (size_t i = 0; i < input->ops; ++i) {
+        double value;
+        switch (random_next() % 3) {
+            case 0: value = (double)(random_next() % 1000000) / 100.0; break;
+            case 1: value = (double)(int64_t)(random_next() % 2000000) - 1000000.0; break;
+            default: {
+                uint64_t bits = random_next() & ~((uint64_t)0x7FF << 52);
+                bits |= (uint64_t)(1023 - 60 + random_next() % 120) << 52;
+                memcpy(&value, &bits, sizeof(value));
+                break;
+            }
+        }
+        append_or_die(&input->data, (const char*)&value, sizeof(value));
+    }
+}
+
+// Null-terminated JSON numbers; size is in bytes of text.
+static void prepare_numbers(sample_t* input, size_t size) {
+    input->ops = 0;
+    while (input->data.size < size) {
+        char text[32];
+        int length;
+        switch (random_next() % 3) {
+            case 0: length = snprintf(text, sizeof(text), "%u", (unsigned)(random_next() % 100000)); break;
+            case 1: length = snprintf(text, sizeof(text), "%u.%02u", (unsigned)(random_next() % 10000), (unsigned)(random_next() % 100)); break;
+            default: length = snprintf(text, sizeof(text), "%u.%015llue-%u", (unsigned)(1 + random_next() % 9),
+                             (unsigned long long)(random_next() % 1000000000000000ull), (unsigned)(random_next() % 300)); break;
+        }
+        append_or_die(&input->data, text, (size_t)length + 1);
+        ++input->ops;
+    }
+}
+
+static size_t run_base64_decode(sample_t* input) {
+    size_t count, error_offset;
+    char* out = buffer_scratch(&input->output, base64_decoded_size(input->data.size));
+    base64_decode(input->data.data, input->data.size, out, &count, &error_offset);
+    return count;
+}
+
+static size_t run_base64_encode(sample_t* input) {
+    char* out = buffer_scratch(&input->output, base64_encoded_size(input->data.size));
+    return base64_encode(input->data.data, input->data.size, out);
+}
+
+static size_t run_json_escape(sample_t* input) {
+    input->output.size = 0;
+    BufferStream stream(&input->output);
+    json_escape(stream, input->data.data, input->data.size);
+    return input->output.size;
+}
+
+static size_t run_string(sample_t* input) {
+    input->output.size = 0;
+    BufferStream stream(&input->output);
+    JsonWriter<Writer<BufferStream>, BufferStream> writer(stream);
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, input->data.data, input->data.size);
+    uint32_t length = mpack_expect_str(&reader);
+    string(&reader, writer, &input->options, length);
+    mpack_reader_destroy(&reader);
+    return input->output.size;
+}
+
+static size_t run_base64_bin(sample_t* input) {
+    input->output.size = 0;
+    BufferStream stream(&input->output);
+    JsonWriter<Writer<BufferStream>, BufferStream> writer(stream);
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, input->data.data, input->data.size);
+    uint32_t length = mpack_expect_bin(&reader);
+    base64_bin(&reader, writer, &input->options, &input->scratch, length, true);
+    mpack_reader_destroy(&reader);
+    return input->output.size;
+}
+
+static size_t run_describe_bin(sample_t* input) {
+    char buf[BIN_EXT_DESCRIPTION_LENGTH];
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, input->data.data, input->data.size);
+    uint32_t length = mpack_expect_bin(&reader);
+    describe_bin(&reader, length, buf, sizeof(buf));
+    mpack_reader_destroy(&reader);
+    return strlen(buf);
+}
+
+static size_t run_number(sample_t* input) {
+    input->output.size = 0;
+    BufferStream stream(&input->output);
+    JsonWriter<Writer<BufferStream>, BufferStream> writer(stream);
+    const double* values = (const double*)input->data.data;
+    writer.StartArray();
+    for (size_t i = 0; i < input->ops; ++i)
+        number(writer, values[i]);
+    writer.EndArray();
+    return input->output.size;
+}
+
+static size_t run_format_double(sample_t* input) {
+    char buf[JSON_NUMBER_BUFFER_SIZE];
+    const double* values = (const double*)input->data.data;
+    size_t total = 0;
+    for (size_t i = 0; i < input->ops; ++i)
+        total += json_format_double(values[i], buf);
+    return total;
+}
+
+static size_t run_format_float(sample_t* input) {
+    char buf[JSON_NUMBER_BUFFER_SIZE];
+    const double* values = (const double*)input->data.data;
+    size_t total = 0;
+    for (size_t i = 0; i < input->ops; ++i)
+        total += json_format_float((float)values[i], buf);
+    return total;
+}
+
+static size_t run_parse_number(sample_t* input) {
+    const char* p = input->data.data;
+    size_t total = 0;
+    for (size_t i = 0; i < input->ops; ++i) {
+        size_t length = strlen(p);
+        json_number_t value;
+        json_parse_number(p, length, &value);
+        total += (size_t)value.type;
+        p += length + 1;
+    }
+    return total;
+}
+
+static const kernel_t kernels[] = {
+    {"base64_decode",     prepare_base64,  run_base64_decode},
+    {"base64_encode",     prepare_bytes,   run_base64_encode},
+    {"base64_bin",        prepare_bin,     run_base64_bin},
+    {"json_escape",       prepare_text,    run_json_escape},
+    {"string",            prepare_str,     run_string},
+    {"describe_bin",      prepare_bin,     run_describe_bin},
+    {"number",            prepare_doubles, run_number},
+    {"json_format_double", prepare_doubles, run_format_double},
+    {"json_format_float", prepare_doubles, run_format_float},
+    {"json_parse_number", prepare_numbers, run_parse_number},
+};
+
+static const size_t sizes[] = {16, 64, 256, 1024, 4096, 65536, 1048576};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Results are accumulated here so that the runs can't be optimized away.
+static volatile size_t sink;
+
+static void measure(const kernel_t* kernel, size_t size, double min_seconds) {
+    sample_t input;
+    memset(&input, 0, sizeof(input));
+    input.options.command = "microbench";
+    input.options.base64 = true;
+    input.options.base64_prefix = true;
+    input.ops = 1;
+    kernel->prepare(&input, size);
+    input.bytes = input.data.size;
+
+    // Double the iterations until the runs take long enough to time.
+    sink += kernel->run(&input); // warm up
+    size_t iterations = 1;
+    double elapsed;
+    while (true) {
+        double start = now();
+        for (size_t i = 0; i < iterations; ++i)
+            sink += kernel->run(&input);
+        elapsed = now() - start;
+        if (elapsed >= min_seconds)
+            break;
+        iterations *= 2;
+    }
+
+    double ns = elapsed * 1e9 / (double)iterations;
+    printf("{\"kernel\":\"%s\",\"bytes\":%zu,\"ops\":%zu,\"iterations\":%zu,\"ns_per_op\":%.3f,\"ns_per_byte\":%.4f}\n",
+            kernel->name, input.bytes, input.ops, iterations, ns / (double)input.ops,
+            input.bytes ? ns / (double)input.bytes : 0.0);
+    fflush(stdout);
+
+    buffer_destroy(&input.data);
+    buffer_destroy(&input.output);
+    buffer_destroy(&input.scratch);
+}
+
+int main(int argc, char** argv) {
+    double min_seconds = 0.05;
+
+    opterr = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:h?")) != -1) {
+        switch (opt) {
+            case 't':
+                min_seconds = atof(optarg) / 1000.0;
+                if (min_seconds > 0)
+                    break;
+                // fallthrough
+            default:
+                fprintf(stderr, "Usage: %s [-t <milliseconds>] [<kernel>...]\n", argv[0]);
+                fprintf(stderr, "Kernels:");
+                for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i)
+                    fprintf(stderr, " %s", kernels[i].name);
+                fprintf(stderr, "\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (int j = optind; j < argc; ++j) {
+        bool found = false;
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i)
+            if (strcmp(argv[j], kernels[i].name) == 0)
+                found = true;
+        if (!found) {
+            fprintf(stderr, "%s: unknown kernel \"%s\"\n", argv[0], argv[j]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); ++i) {
+        // run only the named kernels, if any
+        bool selected = (optind == argc);
+        for (int j = optind; j < argc; ++j)
+            if (strcmp(argv[j], kernels[i].name) == 0)
+                selected = true;
+        if (!selected)
+            continue;
+
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(*sizes); ++j)
+            measure(&kernels[i], sizes[j], min_seconds);
+    }
+
+    return EXIT_SUCCESS;
+}
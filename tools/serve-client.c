@@ -0,0 +1,176 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015-2017 Nicholas Fraser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// A client for msgpacktoolsd, used by tools/test.sh. Sends a request to
+// convert each file with the given tool and options on one connection, and
+// writes the output of each response to stdout. Requests are sent on a
+// separate thread so that they are pipelined with the responses.
+//
+// Usage: serve-client <socket> <header> <file>...
+//
+// where header is the tool and its options, e.g. "msgpack2json -p". Exits
+// with failure if any response is an error, printing its message.
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct client_t {
+    int fd;
+    const char* header;
+    char** files;
+    int count;
+    bool failed;
+} client_t;
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static void put_u32(char* p, uint32_t value) {
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+static bool send_file(client_t* client, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "serve-client: could not open \"%s\"\n", filename);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (char*)malloc(size > 0 ? (size_t)size : 1);
+    bool ok = data && size >= 0 && fread(data, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+
+    char length[4];
+    size_t header_size = strlen(client->header);
+    put_u32(length, (uint32_t)header_size);
+    ok = ok && send_all(client->fd, length, 4) && send_all(client->fd, client->header, header_size);
+    put_u32(length, (uint32_t)size);
+    ok = ok && send_all(client->fd, length, 4) && send_all(client->fd, data, (size_t)size);
+    free(data);
+    return ok;
+}
+
+static void* send_requests(void* arg) {
+    client_t* client = (client_t*)arg;
+    for (int i = 0; i < client->count; ++i) {
+        if (!send_file(client, client->files[i])) {
+            client->failed = true;
+            break;
+        }
+    }
+    shutdown(client->fd, SHUT_WR);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <socket> <header> <file>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the server may close the connection before all requests are sent
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "%s: could not connect to \"%s\"\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    client_t client = {fd, argv[2], argv + 3, argc - 3, false};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, send_requests, &client) != 0) {
+        fprintf(stderr, "%s: could not start thread\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < client.count; ++i) {
+        char header[5];
+        if (!receive_all(fd, header, sizeof(header))) {
+            fprintf(stderr, "%s: connection closed\n", argv[0]);
+            ok = false;
+            break;
+        }
+        const uint8_t* u = (const uint8_t*)header + 1;
+        uint32_t size = ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+        char* body = (char*)malloc(size ? size : 1);
+        if (!body || !receive_all(fd, body, size)) {
+            fprintf(stderr, "%s: connection closed\n", argv[0]);
+            free(body);
+            ok = false;
+            break;
+        }
+        if (header[0] == 0) {
+            fwrite(body, 1, size, stdout);
+        } else {
+            fprintf(stderr, "%s: %.*s\n", argv[0], (int)size, body);
+            ok = false;
+        }
+        free(body);
+    }
+
+    pthread_join(thread, NULL);
+    close(fd);
+    if (fflush(stdout) != 0 || client.failed)
+        ok = false;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
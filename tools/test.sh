@@ -59,16 +59,21 @@ go() {
     run_test "json2msgpack-basic-lax" ${TESTS_DIR}/basic.mp 0 ${VALGRIND} ./json2msgpack -li ${TESTS_DIR}/basic-lax.json
     run_test "json2msgpack-basic-base64" ${TESTS_DIR}/basic.mp 0 ${VALGRIND} ./json2msgpack -B 22 -bi ${TESTS_DIR}/basic.json
     run_test "json2msgpack-basic-strict-fail" no-compare 1 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/basic-lax.json
+    run_test "json2msgpack-stdin" ${TESTS_DIR}/basic.mp 0 bash -c "cat ${TESTS_DIR}/basic.json | ${VALGRIND} ./json2msgpack"
 
     run_test "msgpack2json-basic-min" ${TESTS_DIR}/basic-min.json 0 ${VALGRIND} ./msgpack2json -i ${TESTS_DIR}/basic.mp
     run_test "msgpack2json-basic" ${TESTS_DIR}/basic.json 0 ${VALGRIND} ./msgpack2json -pi ${TESTS_DIR}/basic.mp
     run_test "msgpack2json-basic-debug" ${TESTS_DIR}/basic.json 0 ${VALGRIND} ./msgpack2json -di ${TESTS_DIR}/basic.mp
     run_test "msgpack2json-stdin" ${TESTS_DIR}/basic.json 0 bash -c "cat ${TESTS_DIR}/basic.mp | ${VALGRIND} ./msgpack2json -p"
     run_test "msgpack2json-bin-ext-debug" ${TESTS_DIR}/bin-ext-debug.txt 0 ${VALGRIND} ./msgpack2json -di ${TESTS_DIR}/base64-bin-ext.mp
+    run_test "msgpack2json-base64-prefix" ${TESTS_DIR}/base64-prefix.json 0 ${VALGRIND} ./msgpack2json -bpi ${TESTS_DIR}/base64-bin-ext.mp
+    run_test "msgpack2json-base64-no-prefix" ${TESTS_DIR}/base64-detect.json 0 ${VALGRIND} ./msgpack2json -Bpi ${TESTS_DIR}/base64-bin-ext.mp
+    run_test "msgpack2json-base64-stdin" ${TESTS_DIR}/base64-prefix.json 0 bash -c "cat ${TESTS_DIR}/base64-bin-ext.mp | ${VALGRIND} ./msgpack2json -bp"
 
     run_test "json2msgpack-base64-str-prefix" ${TESTS_DIR}/base64-str-prefix.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/base64-prefix.json
     run_test "json2msgpack-base64-bin" ${TESTS_DIR}/base64-bin-ext.mp 0 ${VALGRIND} ./json2msgpack -bi ${TESTS_DIR}/base64-prefix.json
     run_test "json2msgpack-base64-bin-lax" ${TESTS_DIR}/base64-bin-ext.mp 0 ${VALGRIND} ./json2msgpack -bli ${TESTS_DIR}/base64-prefix-lax.json
+    run_test "json2msgpack-base64-invalid-fail" no-compare 1 ${VALGRIND} ./json2msgpack -bi ${TESTS_DIR}/base64-invalid.json
 
     run_test "json2msgpack-base64-no-detect-str" ${TESTS_DIR}/base64-str.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/base64-detect.json
     run_test "json2msgpack-base64-detect-str" ${TESTS_DIR}/base64-str.mp 0 ${VALGRIND} ./json2msgpack -B 200 -i ${TESTS_DIR}/base64-detect.json
@@ -79,14 +84,264 @@ go() {
     run_test "json2msgpack-base64-mixed-bin" ${TESTS_DIR}/base64-bin-ext.mp 0 ${VALGRIND} ./json2msgpack -bB 22 -i ${TESTS_DIR}/base64-mixed.json
 
     run_test "json2msgpack-value-string" ${TESTS_DIR}/value-string.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/value-string.json
+    run_test "json2msgpack-value-string-long" ${TESTS_DIR}/value-string-long.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/value-string-long.json
     run_test "json2msgpack-value-int" ${TESTS_DIR}/value-int.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/value-int.json
+    run_test "json2msgpack-numbers" ${TESTS_DIR}/numbers.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/numbers.json
     run_test "msgpack2json-value-string" ${TESTS_DIR}/value-string.json 0 ${VALGRIND} ./msgpack2json -i ${TESTS_DIR}/value-string.mp
+    run_test "msgpack2json-value-string-long" ${TESTS_DIR}/value-string-long.json 0 ${VALGRIND} ./msgpack2json -i ${TESTS_DIR}/value-string-long.mp
+    run_test "msgpack2json-value-string-long-stdin" ${TESTS_DIR}/value-string-long.json 0 bash -c "cat ${TESTS_DIR}/value-string-long.mp | ${VALGRIND} ./msgpack2json"
     run_test "msgpack2json-value-int" ${TESTS_DIR}/value-int.json 0 ${VALGRIND} ./msgpack2json -i ${TESTS_DIR}/value-int.mp
+    run_test "msgpack2json-floats" ${TESTS_DIR}/floats.json 0 ${VALGRIND} ./msgpack2json -i ${TESTS_DIR}/floats.mp
 
     run_test "msgpack2json-continuous-single" ${TESTS_DIR}/basic-min.json 0 ${VALGRIND} ./msgpack2json -ci ${TESTS_DIR}/basic.mp
     run_test "msgpack2json-continuous" ${TESTS_DIR}/continuous.json 0 ${VALGRIND} ./msgpack2json -cpi ${TESTS_DIR}/continuous.mp
     run_test "msgpack2json-continuous-commas" ${TESTS_DIR}/continuous-commas.json 0 ${VALGRIND} ./msgpack2json -Cpi ${TESTS_DIR}/continuous.mp
     run_test "msgpack2json-continuous-commas-min" ${TESTS_DIR}/continuous-commas-min.json 0 ${VALGRIND} ./msgpack2json -Ci ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-continuous-stdin" ${TESTS_DIR}/continuous.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -cp"
+
+    run_test "msgpack2json-parallel" ${TESTS_DIR}/continuous.json 0 ${VALGRIND} ./msgpack2json -j 4 -cpi ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-parallel-commas-min" ${TESTS_DIR}/continuous-commas-min.json 0 ${VALGRIND} ./msgpack2json -j 4 -Ci ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-parallel-stdin" ${TESTS_DIR}/continuous-commas.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -j 4 -Cp"
+
+    # path selection
+    run_test "msgpack2json-select" ${TESTS_DIR}/select-names.json 0 ${VALGRIND} ./msgpack2json -e '[*].name' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-quoted" ${TESTS_DIR}/select-names.json 0 ${VALGRIND} ./msgpack2json -e '$[*]["name"]' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-multiple" ${TESTS_DIR}/select-multiple.json 0 ${VALGRIND} ./msgpack2json -e '[3].favorite_foods[0]' -e '[1].name' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-pretty" ${TESTS_DIR}/select-pretty.json 0 ${VALGRIND} ./msgpack2json -p -e '[0].favorite_foods' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-root" ${TESTS_DIR}/basic.json 0 ${VALGRIND} ./msgpack2json -p -e '$' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-continuous" ${TESTS_DIR}/select-continuous.json 0 ${VALGRIND} ./msgpack2json -c -e '[*].age' -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-select-stdin" ${TESTS_DIR}/select-continuous.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -c -e '[*].age'"
+    run_test "msgpack2json-select-invalid-path-fail" no-compare 1 ${VALGRIND} ./msgpack2json -e 'name' -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-select-delimited-fail" no-compare 1 ${VALGRIND} ./msgpack2json -C -e '.name' -i ${TESTS_DIR}/continuous.mp
+
+    # record ranges, with and without an index
+    printf '"Donna",44' > .build/range.json
+    : > .build/empty.json
+    rm -f .build/continuous.idx
+    run_test "msgpack2json-range" .build/range.json 0 ${VALGRIND} ./msgpack2json -C -r 2:4 -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-range-single" ${TESTS_DIR}/basic-min.json 0 ${VALGRIND} ./msgpack2json -r 0 -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-range-past-end" .build/empty.json 0 ${VALGRIND} ./msgpack2json -r 100: -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-index-build" .build/empty.json 0 ${VALGRIND} ./msgpack2json -I .build/continuous.idx -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-index-range" .build/range.json 0 ${VALGRIND} ./msgpack2json -I .build/continuous.idx -C -r 2:4 -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-index-all" ${TESTS_DIR}/continuous.json 0 ${VALGRIND} ./msgpack2json -I .build/continuous.idx -p -r : -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-index-stale" ${TESTS_DIR}/basic-min.json 0 ${VALGRIND} ./msgpack2json -I .build/continuous.idx -r 0 -i ${TESTS_DIR}/basic.mp
+    # a corrupt index with a record count that overflows the offset count
+    printf 'MPTIDX02\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0' > .build/corrupt.idx
+    printf '\377\377\377\377\377\377\377\377\2\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0' >> .build/corrupt.idx
+    run_test "msgpack2json-index-corrupt" .build/range.json 0 ${VALGRIND} ./msgpack2json -I .build/corrupt.idx -C -r 2:4 -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-range-stdin-fail" no-compare 1 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -r 1"
+    run_test "msgpack2json-range-invalid-fail" no-compare 1 ${VALGRIND} ./msgpack2json -r 4:2 -i ${TESTS_DIR}/continuous.mp
+    head -c 20 ${TESTS_DIR}/continuous.mp > .build/truncated.mp
+    run_test "msgpack2json-index-truncated-fail" no-compare 1 ${VALGRIND} ./msgpack2json -I .build/truncated.idx -i .build/truncated.mp
+
+    # a continuous stream large enough to be split into several jobs
+    cp ${TESTS_DIR}/continuous.mp .build/large.mp
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13; do
+        cat .build/large.mp .build/large.mp > .build/large.tmp
+        mv .build/large.tmp .build/large.mp
+    done
+    ./msgpack2json -Cpi .build/large.mp > .build/large.json
+    run_test "msgpack2json-parallel-large" .build/large.json 0 ${VALGRIND} ./msgpack2json -j 4 -Cpi .build/large.mp
+    run_test "msgpack2json-parallel-large-stdin" .build/large.json 0 bash -c "cat .build/large.mp | ${VALGRIND} ./msgpack2json -j 3 -Cp"
+    ./msgpack2json -c -e '.name' -e '[*].favorite_foods[1]' -i .build/large.mp > .build/large-select.json
+    run_test "msgpack2json-parallel-select" .build/large-select.json 0 ${VALGRIND} ./msgpack2json -j 4 -c -e '.name' -e '[*].favorite_foods[1]' -i .build/large.mp
+    ./msgpack2json -Cp -r 20000:20100 -i .build/large.mp > .build/large-range.json
+    rm -f .build/large.idx
+    run_test "msgpack2json-index-large" .build/large-range.json 0 ${VALGRIND} ./msgpack2json -I .build/large.idx -Cp -r 20000:20100 -i .build/large.mp
+    run_test "msgpack2json-index-large-parallel" .build/large-range.json 0 ${VALGRIND} ./msgpack2json -I .build/large.idx -j 4 -Cp -r 20000:20100 -i .build/large.mp
+
+    run_test "msgpack2json-parallel-array" ${TESTS_DIR}/basic.json 0 ${VALGRIND} ./msgpack2json -j 4 -pi ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-parallel-array-min" ${TESTS_DIR}/basic-min.json 0 ${VALGRIND} ./msgpack2json -j 4 -i ${TESTS_DIR}/basic.mp
+
+    # a single array large enough to be split into several slices: an
+    # array32 header for 0xA000 elements followed by the continuous objects
+    printf '\335\000\000\240\000' | cat - .build/large.mp > .build/large-array.mp
+    ./msgpack2json -pi .build/large-array.mp > .build/large-array.json
+    ./msgpack2json -i .build/large-array.mp > .build/large-array-min.json
+    run_test "msgpack2json-parallel-array-large" .build/large-array.json 0 ${VALGRIND} ./msgpack2json -j 4 -pi .build/large-array.mp
+    run_test "msgpack2json-parallel-array-large-min" .build/large-array-min.json 0 ${VALGRIND} ./msgpack2json -j 3 -i .build/large-array.mp
+
+    run_test "json2msgpack-continuous" ${TESTS_DIR}/continuous.mp 0 ${VALGRIND} ./json2msgpack -i ${TESTS_DIR}/continuous.json
+    run_test "json2msgpack-continuous-stdin" ${TESTS_DIR}/continuous.mp 0 bash -c "cat ${TESTS_DIR}/continuous.json | ${VALGRIND} ./json2msgpack"
+
+    run_test "json2msgpack-parallel" ${TESTS_DIR}/continuous.mp 0 ${VALGRIND} ./json2msgpack -j 4 -i ${TESTS_DIR}/continuous.json
+    run_test "json2msgpack-parallel-lax" ${TESTS_DIR}/basic.mp 0 ${VALGRIND} ./json2msgpack -j 4 -li ${TESTS_DIR}/basic-lax.json
+    run_test "json2msgpack-parallel-stdin" ${TESTS_DIR}/continuous.mp 0 bash -c "cat ${TESTS_DIR}/continuous.json | ${VALGRIND} ./json2msgpack -j 4"
+    run_test "json2msgpack-parallel-strict-fail" no-compare 1 ${VALGRIND} ./json2msgpack -j 4 -i ${TESTS_DIR}/basic-lax.json
+
+    # a sequence of values large enough to be split into several jobs
+    cp ${TESTS_DIR}/continuous.json .build/large-values.json
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13; do
+        cat .build/large-values.json .build/large-values.json > .build/large-values.tmp
+        mv .build/large-values.tmp .build/large-values.json
+    done
+    ./json2msgpack -i .build/large-values.json > .build/large-values.mp
+    run_test "json2msgpack-parallel-large" .build/large-values.mp 0 ${VALGRIND} ./json2msgpack -j 4 -i .build/large-values.json
+    run_test "json2msgpack-parallel-large-stdin" .build/large-values.mp 0 bash -c "cat .build/large-values.json | ${VALGRIND} ./json2msgpack -j 3"
+
+    # with several bad values in different jobs, only the first is reported
+    cat .build/large-values.json ${TESTS_DIR}/basic-lax.json .build/large-values.json ${TESTS_DIR}/basic-lax.json \
+            .build/large-values.json ${TESTS_DIR}/basic-lax.json > .build/large-values-lax.json
+    run_test "json2msgpack-parallel-errors" no-compare 1 ${VALGRIND} ./json2msgpack -j 4 -i .build/large-values-lax.json
+    cp .build/test-stderr .build/parallel-stderr
+    run_test "json2msgpack-parallel-errors-once" no-compare 0 sh -c "test \$(grep -c 'error parsing JSON' .build/parallel-stderr) -eq 1"
+
+    # a write error part-way through the output is reported
+    if [ -e /dev/full ]; then
+        run_test "json2msgpack-write-fail" no-compare 1 ${VALGRIND} ./json2msgpack -i .build/large-values.json -o /dev/full
+        cp .build/test-stderr .build/write-stderr
+        run_test "json2msgpack-write-fail-message" no-compare 0 grep -q "error writing MessagePack" .build/write-stderr
+    fi
+
+    # statistics go to stderr and must not change the output
+    run_test "msgpack2json-stats" ${TESTS_DIR}/basic.json 0 ${VALGRIND} ./msgpack2json -s -pi ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-stats-stdin" ${TESTS_DIR}/continuous.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -S -cp"
+    run_test "msgpack2json-stats-parallel" .build/large.json 0 ${VALGRIND} ./msgpack2json -S -j 4 -Cpi .build/large.mp
+    run_test "json2msgpack-stats" ${TESTS_DIR}/basic.mp 0 ${VALGRIND} ./json2msgpack -s -B 22 -bi ${TESTS_DIR}/basic.json
+    run_test "json2msgpack-stats-stdin" ${TESTS_DIR}/continuous.mp 0 bash -c "cat ${TESTS_DIR}/continuous.json | ${VALGRIND} ./json2msgpack -S"
+    run_test "json2msgpack-stats-parallel" .build/large-values.mp 0 ${VALGRIND} ./json2msgpack -S -j 4 -i .build/large-values.json
+    run_test "msgpack2json-histogram" .build/large.json 0 ${VALGRIND} ./msgpack2json -H -Cpi .build/large.mp
+    run_test "msgpack2json-histogram-parallel" .build/large.json 0 ${VALGRIND} ./msgpack2json -SH -j 4 -Cpi .build/large.mp
+    run_test "json2msgpack-histogram-stdin" .build/large-values.mp 0 bash -c "cat .build/large-values.json | ${VALGRIND} ./json2msgpack -H"
+
+    # SIGUSR1 is answered while the tool is idle waiting for input, as well as at exit
+    run_test "msgpack2json-histogram-signal-idle" no-compare 0 bash -c "sleep 2 | cat | ./msgpack2json -H -c & sleep 1; kill -USR1 \$!; wait"
+    cp .build/test-stderr .build/signal-stderr
+    run_test "msgpack2json-histogram-signal-idle-output" no-compare 0 sh -c "test \$(grep -c 'record latency' .build/signal-stderr) -eq 2"
+
+    run_test "msgpack2json-unbuffered" ${TESTS_DIR}/continuous.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -u -cp"
+    run_test "msgpack2json-unbuffered-parallel" .build/large.json 0 bash -c "cat .build/large.mp | ${VALGRIND} ./msgpack2json -u -j 4 -Cp"
+    run_test "json2msgpack-unbuffered" ${TESTS_DIR}/continuous.mp 0 bash -c "cat ${TESTS_DIR}/continuous.json | ${VALGRIND} ./json2msgpack -u"
+    run_test "json2msgpack-unbuffered-parallel" .build/large-values.mp 0 ${VALGRIND} ./json2msgpack -u -j 4 -i .build/large-values.json
+
+    run_test "msgpack2json-async" .build/large.json 0 bash -c "cat .build/large.mp | ${VALGRIND} ./msgpack2json -a 4 -Cp"
+    run_test "msgpack2json-async-file" .build/large-array.json 0 ${VALGRIND} ./msgpack2json -a 64 -pi .build/large-array.mp
+    run_test "msgpack2json-async-parallel" .build/large.json 0 bash -c "cat .build/large.mp | ${VALGRIND} ./msgpack2json -a 16 -j 4 -Cp"
+
+    # batch mode: each input is converted to a file named from the template
+    rm -rf .build/batch
+    mkdir -p .build/batch/in
+    for NAME in basic continuous value-int value-string floats; do
+        cp ${TESTS_DIR}/$NAME.mp .build/batch/in/$NAME.mp
+    done
+    cp ${TESTS_DIR}/basic.json ${TESTS_DIR}/continuous.json .build/batch/in/
+    run_test "msgpack2json-batch" no-compare 0 ${VALGRIND} ./msgpack2json -j 3 -O .build/batch/%n.min.json \
+        .build/batch/in/basic.mp .build/batch/in/value-int.mp .build/batch/in/value-string.mp
+    run_test "msgpack2json-batch-basic" ${TESTS_DIR}/basic-min.json 0 cat .build/batch/basic.min.json
+    run_test "msgpack2json-batch-int" ${TESTS_DIR}/value-int.json 0 cat .build/batch/value-int.min.json
+    run_test "msgpack2json-batch-string" ${TESTS_DIR}/value-string.json 0 cat .build/batch/value-string.min.json
+    run_test "msgpack2json-batch-list" no-compare 0 bash -c "echo .build/batch/in/continuous.mp | ${VALGRIND} ./msgpack2json -L -cp -O %s-out.json"
+    run_test "msgpack2json-batch-list-output" ${TESTS_DIR}/continuous.json 0 cat .build/batch/in/continuous-out.json
+    run_test "msgpack2json-batch-fail" no-compare 1 ${VALGRIND} ./msgpack2json -j 2 .build/batch/in/missing.mp .build/batch/in/floats.mp
+    run_test "msgpack2json-batch-fail-continues" ${TESTS_DIR}/floats.json 0 cat .build/batch/in/floats.json
+    run_test "msgpack2json-batch-output-option" no-compare 1 ${VALGRIND} ./msgpack2json -o .build/batch/out.json .build/batch/in/basic.mp
+    run_test "json2msgpack-batch" no-compare 0 bash -c "ls .build/batch/in/basic.json .build/batch/in/continuous.json | ${VALGRIND} ./json2msgpack -L -j 2 -O .build/batch/%n.mp"
+    run_test "json2msgpack-batch-basic" ${TESTS_DIR}/basic.mp 0 cat .build/batch/basic.mp
+    run_test "json2msgpack-batch-continuous" ${TESTS_DIR}/continuous.mp 0 cat .build/batch/continuous.mp
+    run_test "json2msgpack-batch-template" no-compare 1 ${VALGRIND} ./json2msgpack -O out.mp .build/batch/in/basic.json
+
+    # output names that collide with each other or with an input are rejected before converting anything
+    mkdir -p .build/batch/a .build/batch/b
+    cp ${TESTS_DIR}/basic.mp .build/batch/a/x.mp
+    cp ${TESTS_DIR}/basic.mp .build/batch/b/x.mp
+    run_test "msgpack2json-batch-same-output" no-compare 1 ${VALGRIND} ./msgpack2json -O .build/batch/%n.json .build/batch/a/x.mp .build/batch/b/x.mp
+    cp .build/test-stderr .build/batch-stderr
+    run_test "msgpack2json-batch-same-output-message" no-compare 0 grep -q '"\.build/batch/a/x\.mp" and "\.build/batch/b/x\.mp"' .build/batch-stderr
+    run_test "msgpack2json-batch-same-output-none" no-compare 1 test -e .build/batch/x.json
+    cp ${TESTS_DIR}/basic.mp .build/batch/in/noext
+    run_test "msgpack2json-batch-output-is-input" no-compare 1 ${VALGRIND} ./msgpack2json -O %s .build/batch/in/noext
+    cp .build/test-stderr .build/batch-stderr
+    run_test "msgpack2json-batch-output-is-input-message" no-compare 0 grep -q "which is an input" .build/batch-stderr
+    run_test "msgpack2json-batch-output-is-input-kept" ${TESTS_DIR}/basic.mp 0 cat .build/batch/in/noext
+
+    # validation: nothing is written, and errors report the offset
+    printf '\221\243a\377b' > .build/invalid-utf8.mp
+    printf '{"a":\0}' > .build/null.json
+    printf '["\377"]' > .build/invalid-utf8.json
+    run_test "msgpack2json-validate" .build/empty.json 0 ${VALGRIND} ./msgpack2json -V -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-validate-continuous" .build/empty.json 0 ${VALGRIND} ./msgpack2json -cV -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-validate-stdin" .build/empty.json 0 bash -c "cat ${TESTS_DIR}/continuous.mp | ${VALGRIND} ./msgpack2json -cV"
+    run_test "msgpack2json-validate-base64" .build/empty.json 0 ${VALGRIND} ./msgpack2json -bV -i ${TESTS_DIR}/base64-bin-ext.mp
+    run_test "msgpack2json-validate-trailing-fail" no-compare 1 ${VALGRIND} ./msgpack2json -V -i ${TESTS_DIR}/continuous.mp
+    run_test "msgpack2json-validate-truncated-fail" no-compare 1 ${VALGRIND} ./msgpack2json -cV -i .build/truncated.mp
+    run_test "msgpack2json-validate-bin-fail" no-compare 1 ${VALGRIND} ./msgpack2json -V -i ${TESTS_DIR}/base64-bin-ext.mp
+    run_test "msgpack2json-validate-utf8-fail" no-compare 1 ${VALGRIND} ./msgpack2json -V -i .build/invalid-utf8.mp
+    cp .build/test-stderr .build/validate-stderr
+    run_test "msgpack2json-validate-utf8-offset" no-compare 0 grep -q "offset 3:" .build/validate-stderr
+    printf '\1\2\243a\377b' > .build/invalid-utf8-range.mp
+    run_test "msgpack2json-validate-range-fail" no-compare 1 ${VALGRIND} ./msgpack2json -V -r 2 -i .build/invalid-utf8-range.mp
+    cp .build/test-stderr .build/validate-stderr
+    run_test "msgpack2json-validate-range-offset" no-compare 0 grep -q "offset 4:" .build/validate-stderr
+    run_test "msgpack2json-validate-output-fail" no-compare 1 ${VALGRIND} ./msgpack2json -V -o .build/validate.json -i ${TESTS_DIR}/basic.mp
+    run_test "msgpack2json-validate-batch" no-compare 0 ${VALGRIND} ./msgpack2json -V -O .build/batch/%n.validate.json \
+        .build/batch/in/basic.mp .build/batch/in/floats.mp
+    run_test "msgpack2json-validate-batch-no-output" no-compare 1 test -e .build/batch/basic.validate.json
+    run_test "json2msgpack-validate" .build/empty.json 0 ${VALGRIND} ./json2msgpack -V -i ${TESTS_DIR}/basic.json
+    run_test "json2msgpack-validate-continuous" .build/empty.json 0 ${VALGRIND} ./json2msgpack -V -i ${TESTS_DIR}/continuous.json
+    run_test "json2msgpack-validate-lax" .build/empty.json 0 ${VALGRIND} ./json2msgpack -lV -i ${TESTS_DIR}/basic-lax.json
+    run_test "json2msgpack-validate-strict-fail" no-compare 1 ${VALGRIND} ./json2msgpack -V -i ${TESTS_DIR}/basic-lax.json
+    run_test "json2msgpack-validate-utf8-fail" no-compare 1 ${VALGRIND} ./json2msgpack -V -i .build/invalid-utf8.json
+    run_test "json2msgpack-validate-null-fail" no-compare 1 ${VALGRIND} ./json2msgpack -V -i .build/null.json
+    cp .build/test-stderr .build/validate-stderr
+    run_test "json2msgpack-validate-null-offset" no-compare 0 grep -q "offset 5)" .build/validate-stderr
+    run_test "json2msgpack-validate-null-stdin-fail" no-compare 1 bash -c "cat .build/null.json | ${VALGRIND} ./json2msgpack -V"
+
+    # the library, converting the same files as the tools
+    if [ -e .build/lib-test ]; then
+        run_test "lib-msgpack2json" ${TESTS_DIR}/basic-min.json 0 .build/lib-test msgpack2json buffer ${TESTS_DIR}/basic.mp
+        run_test "lib-msgpack2json-pretty" ${TESTS_DIR}/basic.json 0 .build/lib-test msgpack2json buffer ${TESTS_DIR}/basic.mp p
+        run_test "lib-msgpack2json-stream" ${TESTS_DIR}/continuous.json 0 .build/lib-test msgpack2json stream ${TESTS_DIR}/continuous.mp cp
+        run_test "lib-msgpack2json-stream-large" .build/large.json 0 .build/lib-test msgpack2json stream .build/large.mp Cp
+        run_test "lib-msgpack2json-floats" ${TESTS_DIR}/floats.json 0 .build/lib-test msgpack2json buffer ${TESTS_DIR}/floats.mp
+        run_test "lib-json2msgpack" ${TESTS_DIR}/basic.mp 0 .build/lib-test json2msgpack buffer ${TESTS_DIR}/basic.json
+        run_test "lib-json2msgpack-lax" ${TESTS_DIR}/basic.mp 0 .build/lib-test json2msgpack stream ${TESTS_DIR}/basic-lax.json l
+        run_test "lib-json2msgpack-continuous" ${TESTS_DIR}/continuous.mp 0 .build/lib-test json2msgpack buffer ${TESTS_DIR}/continuous.json
+        run_test "lib-json2msgpack-stream-large" .build/large-values.mp 0 .build/lib-test json2msgpack stream .build/large-values.json
+        run_test "lib-json2msgpack-strict-fail" no-compare 1 .build/lib-test json2msgpack buffer ${TESTS_DIR}/basic-lax.json
+        run_test "lib-msgpack2json-stream-abort" no-compare 1 .build/lib-test msgpack2json stream .build/large.mp Cpa
+        run_test "lib-json2msgpack-stream-abort" no-compare 1 .build/lib-test json2msgpack stream .build/large-values.json a
+    else
+        echo "Skipping library tests; build them with \"make check\"."
+    fi
+
+    # the conversion server, with clients converting the same files as the tools
+    if [ -e ./msgpacktoolsd ] && [ -e .build/serve-client ]; then
+        SOCKET=.build/test.sock
+        ./msgpacktoolsd -j 4 $SOCKET 2>.build/serve-stderr &
+        SERVER=$!
+        for i in $(seq 50); do
+            [ -S $SOCKET ] && break
+            sleep 0.1
+        done
+        run_test "serve-msgpack2json" ${TESTS_DIR}/basic.json 0 .build/serve-client $SOCKET "msgpack2json -p" ${TESTS_DIR}/basic.mp
+        run_test "serve-msgpack2json-continuous" ${TESTS_DIR}/continuous.json 0 .build/serve-client $SOCKET "msgpack2json -cp" ${TESTS_DIR}/continuous.mp
+        run_test "serve-json2msgpack" ${TESTS_DIR}/basic.mp 0 .build/serve-client $SOCKET "json2msgpack -l" ${TESTS_DIR}/basic-lax.json
+        run_test "serve-json2msgpack-base64" ${TESTS_DIR}/basic.mp 0 .build/serve-client $SOCKET "json2msgpack -B 22 -b" ${TESTS_DIR}/basic.json
+        cat ${TESTS_DIR}/basic.mp ${TESTS_DIR}/continuous.mp ${TESTS_DIR}/basic.mp > .build/serve-pipelined.mp
+        run_test "serve-pipelined" .build/serve-pipelined.mp 0 .build/serve-client $SOCKET "json2msgpack" \
+            ${TESTS_DIR}/basic.json ${TESTS_DIR}/continuous.json ${TESTS_DIR}/basic-min.json
+        run_test "serve-concurrent" no-compare 0 sh -c "
+            for i in 1 2 3 4 5 6 7 8; do
+                .build/serve-client $SOCKET 'msgpack2json -Cp' .build/large.mp > .build/serve-large-\$i.json &
+            done
+            wait
+            for i in 1 2 3 4 5 6 7 8; do
+                cmp .build/large.json .build/serve-large-\$i.json || exit 1
+            done"
+        run_test "serve-strict-fail" no-compare 1 .build/serve-client $SOCKET "json2msgpack" ${TESTS_DIR}/basic-lax.json
+        run_test "serve-invalid-option" no-compare 1 .build/serve-client $SOCKET "msgpack2json -o out.json" ${TESTS_DIR}/basic.mp
+        run_test "serve-invalid-tool" no-compare 1 .build/serve-client $SOCKET "cat" ${TESTS_DIR}/basic.mp
+        run_test "serve-socket-in-use-fail" no-compare 1 ./msgpacktoolsd $SOCKET
+        run_test "serve-socket-in-use-kept" ${TESTS_DIR}/basic.json 0 .build/serve-client $SOCKET "msgpack2json -p" ${TESTS_DIR}/basic.mp
+        kill $SERVER
+        wait $SERVER
+        if [ -e $SOCKET ]; then
+            echo "TEST FAILED: msgpacktoolsd did not remove its socket"
+            exit 1
+        fi
+    else
+        echo "Skipping server tests; build them with \"make check\"."
+    fi
 
     echo "All tests passed."
 }